@@ -0,0 +1,17 @@
+#ifndef KRAKEN_CHUNKSTORE_H
+#define KRAKEN_CHUNKSTORE_H
+
+/*
+ * Layout of the deduplicating store, shared by the server and rebuild.
+ * Chunks live in CHUNK_STORE/<first two hex digits>/<SHA-256 in hex>,
+ * written as <hex>.tmp and renamed once complete, so a name always stands
+ * for the whole chunk. An upload is stored as a manifest in place of the
+ * file: MANIFEST_MAGIC on the first line, then one line per chunk, in
+ * order, with its SHA-256 in hex and its length in bytes.
+ */
+#define CHUNK_STORE             "davy_jones_locker/.chunks"
+#define CHUNK_TMP_SUFFIX        ".tmp"
+#define MANIFEST_MAGIC          "KRK manifest 1"
+#define MANIFEST_LINE_MAX       80
+
+#endif
@@ -0,0 +1,306 @@
+#ifndef KRAKEN_DIGEST_H
+#define KRAKEN_DIGEST_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+/*
+ * Streaming digests of uploads, shared by the servers and the clients.
+ * CRC32C (Castagnoli) uses the SSE4.2 crc32 instruction when the CPU has
+ * it, picked at runtime, and slicing-by-8 tables otherwise. crc32c() is
+ * chainable: start from 0 and feed the result back in with the next piece.
+ * SHA-256 follows FIPS 180-4 and uses the SHA extensions when present.
+ * digest_setup() has to run once before any thread uses either.
+ */
+#define DIGEST_NONE             0
+#define DIGEST_CRC32C           1
+#define DIGEST_SHA256           2
+#define CRC32C_LEN              4
+#define SHA256_LEN              32
+#define DIGEST_MAX              SHA256_LEN
+
+#define CRC32C_POLY             0x82f63b78  // reflected
+
+static uint32_t crc32c_table[8][256];
+static int crc32c_hw_ok;
+static int sha256_hw_ok;
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#if defined(__x86_64__)
+#include <cpuid.h>
+#include <immintrin.h>
+
+__attribute__((target("sse4.2")))
+static inline uint32_t crc32c_hw(uint32_t crc, const uint8_t *p, size_t len)
+{
+    uint64_t c = crc;
+    while (len && ((uintptr_t)p & 7)) {
+        c = _mm_crc32_u8(c, *p++);
+        --len;
+    }
+    for (; len >= 8; p += 8, len -= 8)
+        c = _mm_crc32_u64(c, *(const uint64_t *)p);
+    while (len--)
+        c = _mm_crc32_u8(c, *p++);
+    return c;
+}
+
+/*
+ * SHA-256 rounds on the SHA extensions. The state is kept as ABEF and CDGH
+ * halves, and each group of four message words is expanded from the four
+ * before it, held in msg[] by group number modulo 4.
+ */
+__attribute__((target("sha,ssse3,sse4.1")))
+static inline void sha256_blocks_hw(uint32_t state[8], const uint8_t *p, size_t blocks)
+{
+    const __m128i bswap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    __m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[0]), 0xb1);
+    __m128i state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[4]), 0x1b);
+    __m128i state0 = _mm_alignr_epi8(tmp, state1, 8);
+    __m128i msg[4], m;
+    state1 = _mm_blend_epi16(state1, tmp, 0xf0);
+    for (; blocks; --blocks, p += 64) {
+        __m128i abef = state0, cdgh = state1;
+        for (int g = 0; g < 16; ++g) {
+            if (g < 4)
+                msg[g] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p + 16 * g)), bswap);
+            else
+                msg[g & 3] = _mm_sha256msg2_epu32(
+                    _mm_add_epi32(_mm_sha256msg1_epu32(msg[g & 3], msg[(g + 1) & 3]),
+                                  _mm_alignr_epi8(msg[(g + 3) & 3], msg[(g + 2) & 3], 4)),
+                    msg[(g + 3) & 3]);
+            m = _mm_add_epi32(msg[g & 3], _mm_loadu_si128((const __m128i *)&sha256_k[4 * g]));
+            state1 = _mm_sha256rnds2_epu32(state1, state0, m);
+            state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(m, 0x0e));
+        }
+        state0 = _mm_add_epi32(state0, abef);
+        state1 = _mm_add_epi32(state1, cdgh);
+    }
+    tmp = _mm_shuffle_epi32(state0, 0x1b);
+    state1 = _mm_shuffle_epi32(state1, 0xb1);
+    _mm_storeu_si128((__m128i *)&state[0], _mm_blend_epi16(tmp, state1, 0xf0));
+    _mm_storeu_si128((__m128i *)&state[4], _mm_alignr_epi8(state1, tmp, 8));
+}
+#endif
+
+static inline void digest_setup()
+{
+    for (uint32_t n = 0; n < 256; ++n) {
+        uint32_t c = n;
+        for (int k = 0; k < 8; ++k)
+            c = c & 1 ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+        crc32c_table[0][n] = c;
+    }
+    for (uint32_t n = 0; n < 256; ++n)
+        for (int k = 1; k < 8; ++k)
+            crc32c_table[k][n] = (crc32c_table[k - 1][n] >> 8) ^
+                                 crc32c_table[0][crc32c_table[k - 1][n] & 0xff];
+#if defined(__x86_64__)
+    unsigned eax, ebx, ecx, edx;
+    crc32c_hw_ok = __builtin_cpu_supports("sse4.2");
+    /* CPUID.(EAX=7,ECX=0):EBX bit 29 */
+    sha256_hw_ok = __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx >> 29 & 1) &&
+                   __builtin_cpu_supports("sse4.1");
+#endif
+}
+
+static inline uint32_t crc32c_sw(uint32_t crc, const uint8_t *p, size_t len)
+{
+    while (len && ((uintptr_t)p & 7)) {
+        crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+        --len;
+    }
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        v ^= crc;
+        crc = crc32c_table[7][v & 0xff] ^ crc32c_table[6][(v >> 8) & 0xff] ^
+              crc32c_table[5][(v >> 16) & 0xff] ^ crc32c_table[4][(v >> 24) & 0xff] ^
+              crc32c_table[3][(v >> 32) & 0xff] ^ crc32c_table[2][(v >> 40) & 0xff] ^
+              crc32c_table[1][(v >> 48) & 0xff] ^ crc32c_table[0][v >> 56];
+    }
+    while (len--)
+        crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+static inline uint32_t crc32c(uint32_t crc, const void *data, size_t len)
+{
+#if defined(__x86_64__)
+    if (crc32c_hw_ok) return ~crc32c_hw(~crc, data, len);
+#endif
+    return ~crc32c_sw(~crc, data, len);
+}
+
+struct sha256_ctx {
+    uint32_t h[8];
+    uint64_t len;               /* bytes fed so far */
+    uint8_t block[64];
+};
+
+#define SHA256_ROR(x, n)        (((x) >> (n)) | ((x) << (32 - (n))))
+
+static inline void sha256_block_sw(struct sha256_ctx *ctx, const uint8_t *p)
+{
+    uint32_t w[64], a, b, c, d, e, f, g, h;
+    for (int i = 0; i < 16; ++i)
+        w[i] = (uint32_t)p[4 * i] << 24 | (uint32_t)p[4 * i + 1] << 16 |
+               (uint32_t)p[4 * i + 2] << 8 | p[4 * i + 3];
+    for (int i = 16; i < 64; ++i) {
+        uint32_t s0 = SHA256_ROR(w[i - 15], 7) ^ SHA256_ROR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = SHA256_ROR(w[i - 2], 17) ^ SHA256_ROR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    a = ctx->h[0]; b = ctx->h[1]; c = ctx->h[2]; d = ctx->h[3];
+    e = ctx->h[4]; f = ctx->h[5]; g = ctx->h[6]; h = ctx->h[7];
+    for (int i = 0; i < 64; ++i) {
+        uint32_t t1 = h + (SHA256_ROR(e, 6) ^ SHA256_ROR(e, 11) ^ SHA256_ROR(e, 25)) +
+                      ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+        uint32_t t2 = (SHA256_ROR(a, 2) ^ SHA256_ROR(a, 13) ^ SHA256_ROR(a, 22)) +
+                      ((a & b) ^ (a & c) ^ (b & c));
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+    ctx->h[0] += a; ctx->h[1] += b; ctx->h[2] += c; ctx->h[3] += d;
+    ctx->h[4] += e; ctx->h[5] += f; ctx->h[6] += g; ctx->h[7] += h;
+}
+
+static inline void sha256_blocks(struct sha256_ctx *ctx, const uint8_t *p, size_t blocks)
+{
+#if defined(__x86_64__)
+    if (sha256_hw_ok) {
+        sha256_blocks_hw(ctx->h, p, blocks);
+        return;
+    }
+#endif
+    for (; blocks; --blocks, p += 64)
+        sha256_block_sw(ctx, p);
+}
+
+static inline void sha256_init(struct sha256_ctx *ctx)
+{
+    static const uint32_t h0[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    memcpy(ctx->h, h0, sizeof(h0));
+    ctx->len = 0;
+}
+
+static inline void sha256_update(struct sha256_ctx *ctx, const void *data, size_t len)
+{
+    const uint8_t *p = data;
+    size_t have = ctx->len & 63;
+    ctx->len += len;
+    if (have) {
+        size_t n = 64 - have < len ? 64 - have : len;
+        memcpy(ctx->block + have, p, n);
+        p += n;
+        len -= n;
+        if (have + n < 64) return;
+        sha256_blocks(ctx, ctx->block, 1);
+    }
+    sha256_blocks(ctx, p, len / 64);
+    memcpy(ctx->block, p + len / 64 * 64, len % 64);
+}
+
+static inline void sha256_final(struct sha256_ctx *ctx, uint8_t out[SHA256_LEN])
+{
+    uint64_t bits = ctx->len * 8;
+    size_t have = ctx->len & 63;
+    ctx->block[have++] = 0x80;
+    if (have > 56) {
+        memset(ctx->block + have, 0, 64 - have);
+        sha256_blocks(ctx, ctx->block, 1);
+        have = 0;
+    }
+    memset(ctx->block + have, 0, 56 - have);
+    for (int i = 0; i < 8; ++i)
+        ctx->block[56 + i] = bits >> (56 - 8 * i);
+    sha256_blocks(ctx, ctx->block, 1);
+    for (int i = 0; i < 8; ++i) {
+        out[4 * i] = ctx->h[i] >> 24;
+        out[4 * i + 1] = ctx->h[i] >> 16;
+        out[4 * i + 2] = ctx->h[i] >> 8;
+        out[4 * i + 3] = ctx->h[i];
+    }
+}
+
+/*
+ * Either digest of one stream. digest_final stores it in out as it goes on
+ * the wire: CRC32C as 4 little-endian bytes, SHA-256 as its 32 bytes.
+ * Returns its length.
+ */
+struct digest_state {
+    uint8_t type;
+    uint32_t crc;
+    struct sha256_ctx sha;
+};
+
+static inline int digest_len(uint8_t type)
+{
+    return type == DIGEST_CRC32C ? CRC32C_LEN : type == DIGEST_SHA256 ? SHA256_LEN : 0;
+}
+
+static inline void digest_init(struct digest_state *d, uint8_t type)
+{
+    d->type = type;
+    d->crc = 0;
+    if (type == DIGEST_SHA256) sha256_init(&d->sha);
+}
+
+static inline void digest_update(struct digest_state *d, const void *data, size_t len)
+{
+    if (d->type == DIGEST_CRC32C) d->crc = crc32c(d->crc, data, len);
+    else if (d->type == DIGEST_SHA256) sha256_update(&d->sha, data, len);
+}
+
+static inline int digest_final(struct digest_state *d, uint8_t out[DIGEST_MAX])
+{
+    if (d->type == DIGEST_CRC32C) {
+        for (int i = 0; i < 4; ++i) out[i] = d->crc >> (8 * i);
+    } else if (d->type == DIGEST_SHA256) {
+        sha256_final(&d->sha, out);
+    }
+    return digest_len(d->type);
+}
+
+/* Lowercase hex as sha256sum prints it, CRC32C most significant byte first */
+static inline void digest_hex(uint8_t type, const uint8_t *digest, char *out)
+{
+    static const char hex[] = "0123456789abcdef";
+    int len = digest_len(type);
+    for (int i = 0; i < len; ++i) {
+        uint8_t b = digest[type == DIGEST_CRC32C ? len - 1 - i : i];
+        out[2 * i] = hex[b >> 4];
+        out[2 * i + 1] = hex[b & 15];
+    }
+    out[2 * len] = '\0';
+}
+
+/* The reverse of digest_hex, returns 0 if hex is not a digest of type */
+static inline int digest_parse_hex(uint8_t type, const char *hex, uint8_t *out)
+{
+    int len = digest_len(type);
+    for (int i = 0; i < 2 * len; ++i) {
+        char c = hex[i];
+        int v = c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 :
+                c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+        if (v < 0) return 0;
+        uint8_t *b = &out[type == DIGEST_CRC32C ? len - 1 - i / 2 : i / 2];
+        *b = i & 1 ? *b | v : v << 4;
+    }
+    return len > 0;
+}
+
+#endif
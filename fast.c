@@ -11,11 +11,16 @@
 #include <fcntl.h>
 #include <arpa/inet.h>
 #include <pthread.h>
+#include <errno.h>
+#include "digest.h"
 
 #define DEFAULT_SERVER_PORT     8001
 #define QUEUE_DEPTH             1
 #define READ_SZ                 4096
 #define WRITE_SZ                4096
+#define BUF_COUNT               64
+#define BUF_GROUP_ID            0
+#define WRITE_DEPTH             16
 #define EVENT_TYPE_ACCEPT       0
 #define EVENT_TYPE_READ         1
 #define EVENT_TYPE_WRITE        2
@@ -26,12 +31,30 @@ typedef struct request {
     int event_type;
     int iovec_count;
     int client_socket;
+    int buf_id;
     struct iovec iov[];
 } request;
 
 struct io_uring ring;
 struct io_uring_params params;
 
+/* Reads land in a ring of preallocated buffers, recycled once written out */
+struct io_uring_buf_ring *buf_ring;
+uint8_t *buf_pool;
+uint32_t buf_available;
+uint8_t read_starved;
+
+/*
+ * Writes go to explicit offsets, so several can be in flight without the
+ * data landing out of order. Reading pauses while WRITE_DEPTH are pending.
+ */
+uint64_t file_off;
+uint32_t writes_inflight;
+uint8_t write_throttled;
+
+/* CRC32C of everything received, reads complete in stream order */
+uint32_t crc;
+
 /*
  One function that prints the system call and the error details
  and then exits with error code 1. Non-zero meaning things didn't go well.
@@ -54,6 +77,19 @@ void *zh_malloc(size_t size) {
     return buf;
 }
 
+/*
+ * With SQPOLL a slot in the SQ ring only frees up once the SQ thread has
+ * consumed the submission in it, so wait for that when the ring is full.
+ * */
+
+struct io_uring_sqe *get_sqe()
+{
+    struct io_uring_sqe *sqe;
+    while (!(sqe = io_uring_get_sqe(&ring)))
+        io_uring_submit(&ring);
+    return sqe;
+}
+
 /*
  * This function is responsible for setting up the main listening socket used by the
  * web server.
@@ -95,7 +131,7 @@ int setup_listening_socket(int port) {
 
 int add_accept_request(int server_socket, struct sockaddr_in *client_addr,
                        socklen_t *client_addr_len) {
-    struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
+    struct io_uring_sqe *sqe = get_sqe();
     io_uring_prep_accept(sqe, server_socket, (struct sockaddr *) client_addr,
                          client_addr_len, 0);
     struct request *req = malloc(sizeof(*req));
@@ -106,24 +142,49 @@ int add_accept_request(int server_socket, struct sockaddr_in *client_addr,
     return 0;
 }
 
+void setup_buffer_ring()
+{
+    int ret;
+    if (posix_memalign((void **)&buf_pool, 4096, BUF_COUNT * READ_SZ))
+        fatal_error("posix_memalign()");
+    buf_ring = io_uring_setup_buf_ring(&ring, BUF_COUNT, BUF_GROUP_ID, 0, &ret);
+    if (!buf_ring) {
+        errno = -ret;
+        fatal_error("io_uring_setup_buf_ring()");
+    }
+    for (int bid = 0; bid < BUF_COUNT; ++bid)
+        io_uring_buf_ring_add(buf_ring, buf_pool + bid * READ_SZ, READ_SZ, bid,
+                              io_uring_buf_ring_mask(BUF_COUNT), bid);
+    io_uring_buf_ring_advance(buf_ring, BUF_COUNT);
+    buf_available = BUF_COUNT;
+}
+
+void recycle_buffer(int bid)
+{
+    io_uring_buf_ring_add(buf_ring, buf_pool + bid * READ_SZ, READ_SZ, bid,
+                          io_uring_buf_ring_mask(BUF_COUNT), 0);
+    io_uring_buf_ring_advance(buf_ring, 1);
+    ++buf_available;
+}
+
 int add_read_request(uint32_t client_sock) {
-    struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
+    struct io_uring_sqe *sqe = get_sqe();
     struct request *req = zh_malloc(sizeof(*req) + sizeof(struct iovec));
-    req->iov[0].iov_base = zh_malloc(READ_SZ);
-    req->iov[0].iov_len = READ_SZ;
     req->event_type = EVENT_TYPE_READ;
-    memset(req->iov[0].iov_base, 0, READ_SZ);
-    /* Linux kernel 5.5 has support for readv, but not for recv() or read() */
-    io_uring_prep_readv(sqe, client_sock, &req->iov[0], 1, 0);
+    req->buf_id = -1;
+    /* The kernel picks the buffer from BUF_GROUP_ID when the data arrives */
+    io_uring_prep_recv(sqe, client_sock, NULL, READ_SZ, 0);
+    sqe->flags |= IOSQE_BUFFER_SELECT;
+    sqe->buf_group = BUF_GROUP_ID;
     io_uring_sqe_set_data(sqe, req);
     io_uring_submit(&ring);
     return 0;
 }
 
-int add_write_request(struct request *req) {
-    struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
+int add_write_request(struct request *req, uint64_t offset) {
+    struct io_uring_sqe *sqe = get_sqe();
     req->event_type = EVENT_TYPE_WRITE;
-    io_uring_prep_writev(sqe, req->client_socket, req->iov, req->iovec_count, 0);
+    io_uring_prep_writev(sqe, req->client_socket, req->iov, req->iovec_count, offset);
     io_uring_sqe_set_data(sqe, req);
     io_uring_submit(&ring);
     return 0;
@@ -144,6 +205,7 @@ void server_loop(int server_socket)
     socklen_t client_addr_len = sizeof(client_addr);
     uint32_t client_sock;
     uint8_t first = 1;
+    uint8_t closing = 0;
     struct timespec tstart={0,0}, tend={0,0};
 
     add_accept_request(server_socket, &client_addr, &client_addr_len);
@@ -154,6 +216,14 @@ void server_loop(int server_socket)
         if (ret < 0)
             fatal_error("io_uring_wait_cqe");
         struct request *req = (struct request *) cqe->user_data;
+        if (req->event_type == EVENT_TYPE_READ && cqe->res == -ENOBUFS) {
+            /* Every buffer is waiting on a disk write, retry once one is recycled */
+            free(req);
+            if (buf_available) add_read_request(client_sock);
+            else read_starved = 1;
+            io_uring_cqe_seen(&ring, cqe);
+            continue;
+        }
         if (cqe->res < 0) {
             fprintf(stderr, "Async request failed: %s for event: %d\n",
                     strerror(-cqe->res), req->event_type);
@@ -164,19 +234,28 @@ void server_loop(int server_socket)
             case EVENT_TYPE_ACCEPT:
                 client_sock = cqe->res;
                 free(req);
-                file_fd = open("fast.tmp", O_WRONLY | O_CREAT | O_TRUNC | O_APPEND,
+                file_fd = open("fast.tmp", O_WRONLY | O_CREAT | O_TRUNC,
                                     S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
                 add_read_request(client_sock);
                 break;
 
             case EVENT_TYPE_READ:
+                if (cqe->flags & IORING_CQE_F_BUFFER) {
+                    req->buf_id = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+                    req->iov[0].iov_base = buf_pool + req->buf_id * READ_SZ;
+                    --buf_available;
+                }
                 if (!cqe->res) {
                     clock_gettime(CLOCK_MONOTONIC, &tend);
                     printf("[fast] took about %.10f seconds\n",
                     ((double)tend.tv_sec + 1.0e-9*tend.tv_nsec) -
                     ((double)tstart.tv_sec + 1.0e-9*tstart.tv_nsec));
                     close(client_sock);
-                    return;
+                    /* fast.tmp is checked once the last write has landed */
+                    if (!writes_inflight) return;
+                    closing = 1;
+                    free(req);
+                    break;
                 }
                 else
                 {
@@ -186,27 +265,33 @@ void server_loop(int server_socket)
                         clock_gettime(CLOCK_MONOTONIC, &tstart);
                     }
                     uint32_t sz = cqe->res;
+                    crc = crc32c(crc, req->iov[0].iov_base, sz);
                     struct request *write_req = zh_malloc(sizeof(*req) + sizeof(struct iovec));
                     write_req->iov[0].iov_base = req->iov[0].iov_base;
                     //write_req->iov[0].iov_base = zh_malloc(WRITE_SZ);
                     write_req->iov[0].iov_len = WRITE_SZ ? sz : WRITE_SZ <= sz;
                     write_req->client_socket = file_fd;
                     write_req->iovec_count = 1;
+                    write_req->buf_id = req->buf_id;
                     //memcpy(write_req->iov[0].iov_base, req->iov[0].iov_base, WRITE_SZ ? sz : WRITE_SZ <= sz);
-                    add_write_request(write_req);
-                    add_read_request(client_sock);
+                    add_write_request(write_req, file_off);
+                    file_off += sz;
+                    if (++writes_inflight < WRITE_DEPTH) add_read_request(client_sock);
+                    else write_throttled = 1;
+                    free(req);
                     break;
                 }
-                free(req->iov[0].iov_base);
-                req->iov[0].iov_base = 0;
-                free(req);
-                break;
 
 
             case EVENT_TYPE_WRITE:
-                for (int i = 0; i < req->iovec_count; i++) {
-                    free(req->iov[i].iov_base);
-                    req->iov[i].iov_base = 0;
+                recycle_buffer(req->buf_id);
+                --writes_inflight;
+                if (closing) {
+                    if (!writes_inflight) return;
+                } else if (read_starved || write_throttled) {
+                    read_starved = 0;
+                    write_throttled = 0;
+                    add_read_request(client_sock);
                 }
                 free(req);
                 break;
@@ -218,16 +303,37 @@ void server_loop(int server_socket)
     }
 }
 
-int main()
+int main(int argc, char *argv[])
 {
+    int opt, ret;
+    uint8_t sqpoll = 0;
+    while ((opt = getopt(argc, argv, "q")) != -1) {
+        if (opt != 'q') {
+            fprintf(stderr, "Usage: %s [-q]\n  -q  let a kernel SQ thread poll for submissions (SQPOLL)\n", argv[0]);
+            exit(1);
+        }
+        sqpoll = 1;
+    }
     signal(SIGINT, sigint_handler);
     int server_socket = setup_listening_socket(DEFAULT_SERVER_PORT);
-    params.flags |= IORING_SETUP_SQPOLL;
-    params.sq_thread_idle = 120000; // 2 minutes in ms
-    //io_uring_queue_init_params(QUEUE_DEPTH, &ring, &params);
-    io_uring_queue_init(QUEUE_DEPTH, &ring, 0);
+    /* Up to WRITE_DEPTH writes and a read complete together, more than the
+     * default CQ of a 1-entry ring holds. The SQ thread also needs some room
+     * to work ahead of us, a single SQ entry stalls it. */
+    params.flags |= IORING_SETUP_CQSIZE;
+    params.cq_entries = WRITE_DEPTH * 2;
+    if (sqpoll) {
+        params.flags |= IORING_SETUP_SQPOLL;
+        params.sq_thread_idle = 120000; // 2 minutes in ms
+    }
+    ret = io_uring_queue_init_params(sqpoll ? WRITE_DEPTH : QUEUE_DEPTH, &ring, &params);
+    if (ret < 0) {
+        errno = -ret;
+        fatal_error("io_uring_queue_init()");
+    }
+    setup_buffer_ring();
+    digest_setup();
     server_loop(server_socket);
-    system("md5sum fast.tmp");
+    printf("[fast] crc32c %08x\n", crc);
     system("shred fast.tmp");
     system("rm fast.tmp");
 }
@@ -0,0 +1,55 @@
+#ifndef KRAKEN_FRAME_H
+#define KRAKEN_FRAME_H
+
+#include <stdint.h>
+
+/*
+ * Framed uploads start with this header, integers are little-endian. It is
+ * followed by name_len bytes of file name and length bytes of payload.
+ * Shared by the server and the clients that speak the framed protocol.
+ * Once a file is stored the server answers with a FRAME_TYPE_ACK header,
+ * its name and no payload, length being the bytes stored.
+ * A file frame flagged FRAME_FLAG_CRC32C or FRAME_FLAG_SHA256 has the digest
+ * of its payload right after it, as digest.h lays it out. The ack carries
+ * the same flag, and FRAME_FLAG_BAD_DIGEST if the payload did not match.
+ * A file frame flagged FRAME_FLAG_RESUME carries no digest but a
+ * FRAME_RESUME_ID_SZ byte content ID right after its name, naming what is
+ * being uploaded. Before any payload is sent the server answers with a
+ * FRAME_TYPE_OFFSET header and the name, length being the bytes of that
+ * name and content ID it already holds durably, and the client goes on with
+ * the payload from that offset on, length minus offset bytes.
+ * A file frame flagged FRAME_FLAG_STRIPE is one byte range of a file sent
+ * over several connections: a frame_stripe follows its name, and its
+ * payload is the length bytes at offset of a file of size bytes. Every
+ * range of one file carries the same transfer ID. Each range is acked,
+ * flagged FRAME_FLAG_STRIPE, with length being the bytes of the file stored
+ * so far, the file is complete once that is its size.
+ */
+#define FRAME_MAGIC             "KRK\x01"
+#define FRAME_MAGIC_SZ          4
+#define FRAME_TYPE_FILE         1
+#define FRAME_TYPE_ACK          2
+#define FRAME_TYPE_OFFSET       3
+#define FRAME_NAME_MAX          255
+#define FRAME_FLAG_CRC32C       0x01
+#define FRAME_FLAG_SHA256       0x02
+#define FRAME_FLAG_RESUME       0x04
+#define FRAME_FLAG_STRIPE       0x08
+#define FRAME_FLAG_BAD_DIGEST   0x80
+#define FRAME_RESUME_ID_SZ      16
+
+struct frame_header {
+    char magic[FRAME_MAGIC_SZ];
+    uint8_t type;
+    uint8_t flags;
+    uint16_t name_len;
+    uint64_t length;
+} __attribute__((packed));
+
+struct frame_stripe {
+    uint8_t id[FRAME_RESUME_ID_SZ];
+    uint64_t offset;
+    uint64_t size;
+} __attribute__((packed));
+
+#endif
@@ -0,0 +1,555 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <time.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <errno.h>
+#include <endian.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+#include "frame.h"
+#include "digest.h"
+
+#define TARGET_MAIN             0
+#define TARGET_FAST             1
+#define TARGET_SLOW             2
+
+#define DEFAULT_HOST            "127.0.0.1"
+#define DEFAULT_CONNS           1
+#define DEFAULT_TRANSFERS       1
+#define DEFAULT_SIZE            (1 << 20)
+#define DEFAULT_CHUNK           4096
+#define CONNECT_TIMEOUT_MS      5000
+
+const char *target_names[] = {"main", "fast", "slow"};
+const uint16_t target_ports[] = {8000, 8001, 8002};
+
+uint8_t target = TARGET_MAIN;
+const char *host = DEFAULT_HOST;
+uint16_t port;
+uint32_t conns = DEFAULT_CONNS;
+uint32_t transfers = DEFAULT_TRANSFERS;
+uint64_t size = DEFAULT_SIZE;
+uint64_t chunk = DEFAULT_CHUNK;
+const char *label;
+const char *out_path;
+
+/*
+ * With -x every file frame carries the digest of its payload, the same for
+ * all of them since they are all the same bytes, so it is computed once up
+ * front and the client side stays out of the measurement.
+ */
+uint8_t digest_type = DIGEST_NONE;
+uint8_t digest[DIGEST_MAX];
+uint64_t bad_digests;
+
+/* The server under test, when its CPU time is to be reported */
+pid_t server_pid;
+uint8_t spawned;
+
+/*
+ * Every connection sends the same chunk over and over, filled once from a
+ * fixed seed so runs are reproducible. The connections are all set up
+ * before any of them starts sending, the run is timed from the first
+ * connection starting to the last one seeing the server close.
+ */
+uint8_t *payload;
+pthread_barrier_t start_barrier;
+/*
+ * With -u every send carries fresh bytes instead, from a generator seeded
+ * per connection, so nothing sent repeats and a deduplicating server has
+ * to store it all.
+ */
+uint8_t unique;
+uint64_t *conn_start;
+uint64_t *conn_end;
+
+/*
+ * conns * transfers latencies. main acks every file once it is stored, so
+ * for main they run from the first byte of a transfer to its ack; acks are
+ * picked up between sends, so they are late by at most one send. fast and
+ * slow acknowledge nothing, there they end with the last byte accepted by
+ * the socket and the wait for the server to close only counts in the
+ * aggregate time. Until its ack a slot holds the transfer's start.
+ */
+uint64_t *latencies;
+uint8_t *acked;
+uint64_t unacked;
+
+/*
+ One function that prints the system call and the error details
+ and then exits with error code 1. Non-zero meaning things didn't go well.
+ */
+void fatal_error(const char *syscall) {
+    perror(syscall);
+    exit(1);
+}
+
+/*
+ * Helper function for cleaner looking code.
+ * */
+
+void *zh_malloc(size_t size) {
+    void *buf = malloc(size);
+    if (!buf) {
+        fprintf(stderr, "Fatal error: unable to allocate memory.\n");
+        exit(1);
+    }
+    return buf;
+}
+
+uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+uint64_t parse_size(const char *arg)
+{
+    char *end;
+    uint64_t size = strtoull(arg, &end, 0);
+    switch (toupper((unsigned char)*end)) {
+    case 'G': size <<= 10; /* fall through */
+    case 'M': size <<= 10; /* fall through */
+    case 'K': size <<= 10;
+    }
+    return size;
+}
+
+/*
+ * utime + stime of the server process itself, not of the children it
+ * waited for, read from /proc/<pid>/stat. A server that already exited
+ * stays readable as a zombie until we reap it.
+ */
+double server_cpu_seconds()
+{
+    char path[64], buf[1024];
+    snprintf(path, sizeof(path), "/proc/%d/stat", server_pid);
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) fatal_error("open() /proc/<pid>/stat");
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0) fatal_error("read() /proc/<pid>/stat");
+    buf[n] = 0;
+    /* the command name may contain spaces, fields are counted after it */
+    char *p = strrchr(buf, ')');
+    unsigned long utime, stime;
+    if (!p || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+                     &utime, &stime) != 2) {
+        fprintf(stderr, "Unexpected format in %s\n", path);
+        exit(1);
+    }
+    return (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+/*
+ * A server that just exited can keep its listening socket a little longer,
+ * until its io_uring is torn down and the armed accept drops its reference.
+ * Under SO_REUSEPORT a new server would share the port with it and some
+ * connections would be reset, so wait until binding the port works.
+ */
+void wait_port_free()
+{
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    for (int waited = 0; ; waited += 10) {
+        int sock = socket(AF_INET, SOCK_STREAM, 0);
+        if (sock < 0) fatal_error("socket()");
+        int enable = 1;
+        setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+        int ret = bind(sock, (struct sockaddr *)&addr, sizeof(addr));
+        close(sock);
+        if (!ret) return;
+        if (errno != EADDRINUSE || waited >= CONNECT_TIMEOUT_MS)
+            fatal_error("bind()");
+        usleep(10000);
+    }
+}
+
+/*
+ * Starts the server under test with stdin from /dev/null, and its output on
+ * our stderr so stdout only carries results. It is killed if we die first,
+ * a leftover server would take part of the next run's connections.
+ */
+void spawn_server(char *argv[])
+{
+    wait_port_free();
+    server_pid = fork();
+    if (server_pid < 0) fatal_error("fork()");
+    if (!server_pid) {
+        prctl(PR_SET_PDEATHSIG, SIGKILL);
+        int null_fd = open("/dev/null", O_RDONLY);
+        if (null_fd < 0) fatal_error("open() /dev/null");
+        dup2(null_fd, STDIN_FILENO);
+        dup2(STDERR_FILENO, STDOUT_FILENO);
+        execvp(argv[0], argv);
+        fatal_error("execvp()");
+    }
+    spawned = 1;
+}
+
+/*
+ * A freshly spawned server may not be listening yet, so refused connections
+ * are retried for a while. No probe connection is made, fast and slow only
+ * ever accept one.
+ */
+int connect_server()
+{
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, host, &addr.sin_addr) != 1) {
+        fprintf(stderr, "Invalid address %s\n", host);
+        exit(1);
+    }
+    for (int waited = 0; ; waited += 10) {
+        int sock = socket(AF_INET, SOCK_STREAM, 0);
+        if (sock < 0) fatal_error("socket()");
+        if (!connect(sock, (struct sockaddr *)&addr, sizeof(addr)))
+            return sock;
+        if (errno != ECONNREFUSED || waited >= CONNECT_TIMEOUT_MS)
+            fatal_error("connect()");
+        close(sock);
+        usleep(10000);
+    }
+}
+
+void send_all(int sock, const void *buf, size_t len)
+{
+    while (len) {
+        ssize_t n = send(sock, buf, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            fatal_error("send()");
+        }
+        buf = (const uint8_t *)buf + n;
+        len -= n;
+    }
+}
+
+void send_frame_header(int sock, uint32_t conn_idx, uint32_t transfer)
+{
+    struct {
+        struct frame_header hdr;
+        char name[FRAME_NAME_MAX];
+    } __attribute__((packed)) frame;
+    int name_len = snprintf(frame.name, sizeof(frame.name), "loadgen_%u_%u", conn_idx, transfer);
+    memcpy(frame.hdr.magic, FRAME_MAGIC, FRAME_MAGIC_SZ);
+    frame.hdr.type = FRAME_TYPE_FILE;
+    frame.hdr.flags = digest_type == DIGEST_CRC32C ? FRAME_FLAG_CRC32C :
+                      digest_type == DIGEST_SHA256 ? FRAME_FLAG_SHA256 : 0;
+    frame.hdr.name_len = htole16(name_len);
+    frame.hdr.length = htole64(size);
+    send_all(sock, &frame, sizeof(frame.hdr) + name_len);
+}
+
+/* Ack frames collected from one connection, they may arrive split */
+struct ack_reader {
+    uint32_t have;
+    char buf[sizeof(struct frame_header) + FRAME_NAME_MAX];
+};
+
+void handle_ack(uint32_t idx, struct ack_reader *r)
+{
+    struct frame_header *hdr = (struct frame_header *)r->buf;
+    uint32_t conn_idx, t;
+    r->buf[sizeof(*hdr) + le16toh(hdr->name_len)] = '\0';
+    if (memcmp(hdr->magic, FRAME_MAGIC, FRAME_MAGIC_SZ) || hdr->type != FRAME_TYPE_ACK ||
+        sscanf(r->buf + sizeof(*hdr), "loadgen_%u_%u", &conn_idx, &t) != 2 ||
+        conn_idx != idx || t >= transfers || le64toh(hdr->length) != size) {
+        fprintf(stderr, "connection %u: unexpected ack\n", idx);
+        exit(1);
+    }
+    uint64_t slot = (uint64_t)idx * transfers + t;
+    latencies[slot] = now_ns() - latencies[slot];
+    acked[slot] = 1;
+    if (hdr->flags & FRAME_FLAG_BAD_DIGEST)
+        __atomic_add_fetch(&bad_digests, 1, __ATOMIC_RELAXED);
+}
+
+/* Reads what the server sent, returns 0 once it closed or, with MSG_DONTWAIT, nothing is there */
+int read_acks(int sock, uint32_t idx, struct ack_reader *r, int flags)
+{
+    char data[4096];
+    ssize_t n = recv(sock, data, sizeof(data), flags);
+    if (n < 0 && (errno == EAGAIN || errno == EINTR)) return 0;
+    if (n <= 0) return 0;
+    for (ssize_t pos = 0; pos < n; ) {
+        struct frame_header *hdr = (struct frame_header *)r->buf;
+        uint32_t want = sizeof(*hdr);
+        if (r->have >= sizeof(*hdr)) want += le16toh(hdr->name_len);
+        uint32_t take = want - r->have < n - pos ? want - r->have : n - pos;
+        memcpy(r->buf + r->have, data + pos, take);
+        r->have += take;
+        pos += take;
+        if (r->have == sizeof(*hdr) && le16toh(hdr->name_len)) continue;
+        if (r->have == want) {
+            handle_ack(idx, r);
+            r->have = 0;
+        }
+    }
+    return 1;
+}
+
+void *run_connection(void *arg)
+{
+    uint32_t idx = (uintptr_t)arg;
+    struct ack_reader reader = { 0 };
+    uint8_t *buf = unique ? zh_malloc(chunk + 8) : payload;
+    uint64_t seed = 0x9e3779b97f4a7c15 * (idx + 1);
+    int sock = connect_server();
+    pthread_barrier_wait(&start_barrier);
+    conn_start[idx] = now_ns();
+    for (uint32_t t = 0; t < transfers; ++t) {
+        uint64_t begin = now_ns();
+        latencies[(uint64_t)idx * transfers + t] = begin;
+        if (target == TARGET_MAIN)
+            send_frame_header(sock, idx, t);
+        for (uint64_t sent = 0; sent < size; ) {
+            uint64_t n = size - sent < chunk ? size - sent : chunk;
+            for (uint64_t i = 0; unique && i < n; i += 8) {
+                seed ^= seed << 13;
+                seed ^= seed >> 7;
+                seed ^= seed << 17;
+                memcpy(buf + i, &seed, 8);
+            }
+            send_all(sock, buf, n);
+            sent += n;
+            if (target == TARGET_MAIN)
+                while (read_acks(sock, idx, &reader, MSG_DONTWAIT));
+        }
+        if (digest_type)
+            send_all(sock, digest, digest_len(digest_type));
+        if (target != TARGET_MAIN)
+            latencies[(uint64_t)idx * transfers + t] = now_ns() - begin;
+    }
+    /* the server closes its side once it has handled, and acked, everything sent */
+    shutdown(sock, SHUT_WR);
+    while (read_acks(sock, idx, &reader, 0));
+    if (target == TARGET_MAIN) {
+        for (uint32_t t = 0; t < transfers; ++t) {
+            uint64_t slot = (uint64_t)idx * transfers + t;
+            if (acked[slot]) continue;
+            /* count it as lasting until the close */
+            latencies[slot] = now_ns() - latencies[slot];
+            __atomic_add_fetch(&unacked, 1, __ATOMIC_RELAXED);
+        }
+    }
+    conn_end[idx] = now_ns();
+    close(sock);
+    if (unique) free(buf);
+    return NULL;
+}
+
+int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+double percentile_ms(uint64_t *sorted, uint64_t count, uint32_t pct)
+{
+    return sorted[(count - 1) * pct / 100] / 1e6;
+}
+
+/*
+ * One human readable line on stdout, and with -o one CSV row appended to the
+ * results file, which gets a header line when it is empty.
+ */
+void report(double elapsed, double cpu)
+{
+    uint64_t count = (uint64_t)conns * transfers;
+    uint64_t total = count * size;
+    double mib = (double)total / 1048576;
+    qsort(latencies, count, sizeof(*latencies), cmp_u64);
+    double p50 = percentile_ms(latencies, count, 50);
+    double p90 = percentile_ms(latencies, count, 90);
+    double p99 = percentile_ms(latencies, count, 99);
+    double max = latencies[count - 1] / 1e6;
+    double cpu_per_gib = total ? cpu * 1073741824 / total : 0;
+
+    printf("%s: %u conns x %u transfers of %lu bytes in %lu byte sends, %.1f MiB in %.3fs, %.1f MiB/s\n",
+           label, conns, transfers, size, chunk, mib, elapsed, mib / elapsed);
+    printf("  %s latency ms p50 %.3f p90 %.3f p99 %.3f max %.3f\n",
+           target == TARGET_MAIN ? "ack" : "send", p50, p90, p99, max);
+    if (unacked)
+        printf("  %lu transfers never acked\n", unacked);
+    if (bad_digests)
+        printf("  %lu transfers acked with a bad digest\n", bad_digests);
+    if (server_pid)
+        printf("  server CPU %.2fs, %.3f CPU s/GiB\n", cpu, cpu_per_gib);
+
+    if (!out_path) return;
+    FILE *out = fopen(out_path, "a");
+    if (!out) fatal_error("fopen()");
+    if (!ftell(out))
+        fprintf(out, "label,target,conns,transfers,size,chunk,bytes,seconds,mib_s,"
+                     "p50_ms,p90_ms,p99_ms,max_ms,server_cpu_s,cpu_s_per_gib\n");
+    fprintf(out, "%s,%s,%u,%u,%lu,%lu,%lu,%.6f,%.2f,%.3f,%.3f,%.3f,%.3f,",
+            label, target_names[target], conns, transfers, size, chunk, total,
+            elapsed, mib / elapsed, p50, p90, p99, max);
+    if (server_pid)
+        fprintf(out, "%.2f,%.4f\n", cpu, cpu_per_gib);
+    else
+        fprintf(out, ",\n");
+    fclose(out);
+}
+
+void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-t main|fast|slow] [-H host] [-P port] [-c conns] [-n transfers] [-s size] [-k chunk] [-x none|crc32c|sha256] [-u] [-p server_pid] [-l label] [-o results.csv] [-- server command]\n", prog);
+    fprintf(stderr, "  -t  server to load, main gets framed uploads, fast and slow raw bytes (default main)\n");
+    fprintf(stderr, "  -H  server address (default %s)\n", DEFAULT_HOST);
+    fprintf(stderr, "  -P  server port (default 8000 for main, 8001 for fast, 8002 for slow)\n");
+    fprintf(stderr, "  -c  concurrent connections (default %u)\n", DEFAULT_CONNS);
+    fprintf(stderr, "  -n  files sent back-to-back on each connection (default %u)\n", DEFAULT_TRANSFERS);
+    fprintf(stderr, "  -s  bytes per file, K/M/G suffixes (default %uM)\n", DEFAULT_SIZE >> 20);
+    fprintf(stderr, "  -k  bytes per send(), K/M/G suffixes (default %u)\n", DEFAULT_CHUNK);
+    fprintf(stderr, "  -x  send every file of main with its digest for the server to check (default none)\n");
+    fprintf(stderr, "  -u  send fresh bytes every time instead of repeating one chunk, not with -x\n");
+    fprintf(stderr, "  -p  pid of a running server to report CPU time for\n");
+    fprintf(stderr, "  -l  name of the run in the results (default: the target)\n");
+    fprintf(stderr, "  -o  append a CSV row with the results to this file\n");
+    fprintf(stderr, "A server command after the options is started first and stopped with SIGINT\n"
+                    "once the run is over, unless it exits by itself, and its CPU time is reported.\n"
+                    "fast and slow take a single connection with one transfer.\n");
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+    /* stop at the first non-option, it starts the server command */
+    while ((opt = getopt(argc, argv, "+t:H:P:c:n:s:k:x:up:l:o:")) != -1) {
+        switch (opt) {
+        case 't':
+            if (!strcmp(optarg, "main"))
+                target = TARGET_MAIN;
+            else if (!strcmp(optarg, "fast"))
+                target = TARGET_FAST;
+            else if (!strcmp(optarg, "slow"))
+                target = TARGET_SLOW;
+            else
+                usage(argv[0]);
+            break;
+        case 'H':
+            host = optarg;
+            break;
+        case 'P':
+            port = strtoul(optarg, NULL, 0);
+            break;
+        case 'c':
+            conns = strtoul(optarg, NULL, 0);
+            break;
+        case 'n':
+            transfers = strtoul(optarg, NULL, 0);
+            break;
+        case 's':
+            size = parse_size(optarg);
+            break;
+        case 'k':
+            chunk = parse_size(optarg);
+            break;
+        case 'x':
+            if (!strcmp(optarg, "none"))
+                digest_type = DIGEST_NONE;
+            else if (!strcmp(optarg, "crc32c"))
+                digest_type = DIGEST_CRC32C;
+            else if (!strcmp(optarg, "sha256"))
+                digest_type = DIGEST_SHA256;
+            else
+                usage(argv[0]);
+            break;
+        case 'u':
+            unique = 1;
+            break;
+        case 'p':
+            server_pid = atoi(optarg);
+            break;
+        case 'l':
+            label = optarg;
+            break;
+        case 'o':
+            out_path = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (!conns || !transfers || !chunk)
+        usage(argv[0]);
+    if (target != TARGET_MAIN && (conns != 1 || transfers != 1 || digest_type))
+        usage(argv[0]);
+    if (unique && digest_type)
+        usage(argv[0]);
+    if (optind < argc && server_pid)
+        usage(argv[0]);
+    if (!port) port = target_ports[target];
+    if (!label) label = target_names[target];
+
+    payload = zh_malloc(chunk);
+    uint64_t seed = 0x9e3779b97f4a7c15;
+    for (uint64_t i = 0; i < chunk; ++i) {
+        seed ^= seed << 13;
+        seed ^= seed >> 7;
+        seed ^= seed << 17;
+        payload[i] = seed;
+    }
+    if (digest_type) {
+        struct digest_state d;
+        digest_setup();
+        digest_init(&d, digest_type);
+        for (uint64_t sent = 0; sent < size; sent += chunk)
+            digest_update(&d, payload, size - sent < chunk ? size - sent : chunk);
+        digest_final(&d, digest);
+    }
+    conn_start = zh_malloc(conns * sizeof(*conn_start));
+    conn_end = zh_malloc(conns * sizeof(*conn_end));
+    latencies = zh_malloc((uint64_t)conns * transfers * sizeof(*latencies));
+    acked = calloc((uint64_t)conns * transfers, 1);
+    if (!acked) fatal_error("calloc()");
+
+    if (optind < argc)
+        spawn_server(&argv[optind]);
+
+    pthread_t *threads = zh_malloc(conns * sizeof(*threads));
+    if (pthread_barrier_init(&start_barrier, NULL, conns + 1))
+        fatal_error("pthread_barrier_init()");
+    for (uint32_t i = 0; i < conns; ++i)
+        if (pthread_create(&threads[i], NULL, &run_connection, (void *)(uintptr_t)i))
+            fatal_error("pthread_create()");
+    /* every connection is up, leave the server's startup out of its CPU time */
+    pthread_barrier_wait(&start_barrier);
+    double cpu_before = server_pid ? server_cpu_seconds() : 0;
+    for (uint32_t i = 0; i < conns; ++i)
+        pthread_join(threads[i], NULL);
+    double cpu = server_pid ? server_cpu_seconds() - cpu_before : 0;
+
+    uint64_t first = conn_start[0], last = conn_end[0];
+    for (uint32_t i = 1; i < conns; ++i) {
+        if (conn_start[i] < first) first = conn_start[i];
+        if (conn_end[i] > last) last = conn_end[i];
+    }
+    report((last - first) / 1e9, cpu);
+
+    if (spawned) {
+        if (target == TARGET_MAIN)
+            kill(server_pid, SIGINT);
+        if (waitpid(server_pid, NULL, 0) < 0)
+            fatal_error("waitpid()");
+    }
+    return 0;
+}
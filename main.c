@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <netinet/in.h>
 #include <string.h>
@@ -10,47 +11,813 @@
 #include <fcntl.h>
 #include <arpa/inet.h>
 #include <pthread.h>
+#include <errno.h>
+#include <sys/eventfd.h>
+#include <endian.h>
+#include <sys/resource.h>
+#include <sched.h>
+#include <poll.h>
+#include <sys/signalfd.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <stddef.h>
+#include <dirent.h>
+#include "frame.h"
+#include "digest.h"
+#include "chunkstore.h"
 
 #define DEFAULT_SERVER_PORT     8000
 #define QUEUE_DEPTH             1024
 #define READ_SZ                 4096
 #define WRITE_SZ                4096
+#define DEFAULT_BUF_COUNT       256
+#define MAX_BUF_COUNT           32768
+#define BUF_GROUP_ID            0
+#define DEFAULT_REQ_POOL_SIZE   (QUEUE_DEPTH * 2)
+#define REQ_SLOT_SZ             64
+#define SPLICE_SZ               65536
+#define DEFAULT_WRITE_DEPTH     16
+#define DEFAULT_MEM_BUDGET      (64 << 20)
+#define DEFAULT_SQ_IDLE         120000 // 2 minutes in ms
+#define DEFAULT_IDLE_TIMEOUT    120    // s
+#define DEFAULT_STALL_TIMEOUT   30     // s
+#define WHEEL_SLOTS             256
+#define WHEEL_TICK_MS           250
+#define WHEEL_TICK_NS           ((uint64_t)WHEEL_TICK_MS * 1000000)
+#define DEFAULT_GROUP_COMMIT_MS 5
+#define SYNC_CHUNK              (8 << 20)
+#define DEFAULT_ARENA           (64 << 20)
+#define DIRECT_CHUNK            (1 << 20)
+#define DIRECT_ALIGN            4096
+#define HUGE_PAGE_SZ            (2 << 20)
+#define MAX_ARENA               (1 << 30)  // per worker, one registered buffer
+#define CDC_MIN                 (16 << 10)
+#define CDC_AVG                 (64 << 10)
+#define CDC_MAX                 (256 << 10)
+#define CDC_MASK_S              0xffffc00000000000ULL  // 18 bits, below CDC_AVG
+#define CDC_MASK_L              0xfffc000000000000ULL  // 14 bits, past it
+#define CHUNK_PATH_SZ           (sizeof("ab/") + 2 * SHA256_LEN)
+#define CHUNK_INDEX_MIN         (1 << 16)
+#define CHUNK_PENDING_BUCKETS   256
+#define MANIFEST_BUF            4096
+#define RESUME_CHECKPOINT       (16 << 20)
+#define RESUME_SUFFIX           ".part"
+#define RESUME_XATTR            "user.kraken.resume"
+#define STRIPE_PREFIX           ".stripe."
+#define STRIPE_KEEP             1024
+
+#define ACCEPT_SINGLE           0
+#define ACCEPT_MULTISHOT        1
+
+#define TRANSFER_COPY           0
+#define TRANSFER_SPLICE         1
+
+#define PROTO_UNKNOWN           0
+#define PROTO_LEGACY            1
+#define PROTO_FRAMED            2
+
+#define FRAME_STATE_HEADER      0
+#define FRAME_STATE_NAME        1
+#define FRAME_STATE_PAYLOAD     2
+#define FRAME_STATE_TRAILER     3
+#define FRAME_STATE_RESUME_ID   4
+#define FRAME_STATE_OFFSET      5
+#define FRAME_STATE_STRIPE      6
+
+#define DURABILITY_NONE         0
+#define DURABILITY_EOF          1
+#define DURABILITY_GROUP        2
+
+#define BACKEND_PLAIN           0
+#define BACKEND_DEDUP           1
+
+#define RESUME_NONE             0
+#define RESUME_LOOKUP           1
+#define RESUME_FRESH            2
+#define RESUME_KNOWN            3
+
+#define DEFER_NONE              0
+#define DEFER_OWN               1
+#define DEFER_BUDGET            2
 
 #define EVENT_TYPE_ACCEPT       0
 #define EVENT_TYPE_READ         1
 #define EVENT_TYPE_WRITE        2
+#define EVENT_TYPE_CONTROL      3
+#define EVENT_TYPE_SPLICE_IN    4
+#define EVENT_TYPE_SPLICE_OUT   5
+#define EVENT_TYPE_TICK         6
+#define EVENT_TYPE_SHUTDOWN     7
+#define EVENT_TYPE_UNLINK       8
+#define EVENT_TYPE_MKDIR        9
+#define EVENT_TYPE_OPEN_DIR     10
+#define EVENT_TYPE_OPEN_FILE    11
+#define EVENT_TYPE_FALLOCATE    12
+#define EVENT_TYPE_SYNC_RANGE   13
+#define EVENT_TYPE_FSYNC        14
+#define EVENT_TYPE_GROUP_COMMIT 15
+#define EVENT_TYPE_ACK          16
+#define EVENT_TYPE_STAGE_IN     17
+#define EVENT_TYPE_STAGE_OUT    18
+#define EVENT_TYPE_SIDECAR_OPEN 19
+#define EVENT_TYPE_SIDECAR_WRITE 20
+#define EVENT_TYPE_SIDECAR_CLOSE 21
+#define EVENT_TYPE_CHUNK_OPEN   22
+#define EVENT_TYPE_CHUNK_WRITE  23
+#define EVENT_TYPE_CHUNK_SYNC   24
+#define EVENT_TYPE_CHUNK_RENAME 25
+#define EVENT_TYPE_CHUNK_CLOSE  26
+#define EVENT_TYPE_MANIFEST     27
+#define EVENT_TYPE_RESUME_READ  28
+#define EVENT_TYPE_CHECKPOINT_SYNC 29
+#define EVENT_TYPE_CHECKPOINT   30
+#define EVENT_TYPE_PART_RENAME  31
+#define EVENT_TYPE_CLOSE_SLOT   32
+#define EVENT_TYPE_COUNT        33
+
+/*
+ * Log-linear histograms in the spirit of HdrHistogram: values below HIST_SUB
+ * get a bucket each, above that every power of two is split in HIST_SUB
+ * buckets, so a value is recorded within 1/HIST_SUB of itself.
+ */
+#define HIST_SUB_BITS           4
+#define HIST_SUB                (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS            ((64 - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
 
 #define FILE 1
 #define SCREEN 2
 
-#define MAX_CONN    1024
+#define LOG_OPEN                0
+#define LOG_TRANSFER            1
+#define LOG_CLOSE               2
+#define LOG_TIMEOUT             3
+#define LOG_ERROR               4
+#define LOG_RING_SZ             4096    // records per worker, power of two
+#define LOG_NAME_SZ             72      // longer names are cut
+#define LOG_FLUSH_MS            50
+#define LOG_BATCH               65536
+#define LOG_LINE_MAX            1024
+
+#define DEFAULT_MAX_CONN        65536
+#define CONN_TABLE_MIN          1024
+#define RESERVED_FDS            64
+#define CONN_FOLDER_SZ          sizeof("davy_jones_locker/255.255.255.255")
+#define DIR_BUCKET_BITS         10
+#define DIR_BUCKETS             (1 << DIR_BUCKET_BITS)
+#define DIR_CACHE_IDLE          256
+
+/*
+ * With -f sockets and upload files are used through a sparse registered
+ * file table: accepts install sockets in [0, max_conn), picked by the
+ * kernel, and upload files go to [max_conn, max_conn + FIXED_FILE_SLOTS),
+ * picked by the worker. Slots are closed on the ring, and an upload file
+ * slot goes back to the worker only once its close completed. Direct accepts are single-shot with their own
+ * address storage, ACCEPT_BATCH of them stay armed.
+ */
+#define FIXED_FILE_SLOTS        2048
+#define ACCEPT_BATCH            16
 
-uint32_t curr_connection = 0;
 uint64_t cmd = -1;
-pthread_mutex_t mutex;
+uint8_t accept_mode = ACCEPT_MULTISHOT;
+uint8_t transfer_mode = TRANSFER_SPLICE;
+uint32_t write_depth = DEFAULT_WRITE_DEPTH;
+uint8_t fixed_files;
+
+/*
+ * At most max_conn connections are admitted over all workers, counted in
+ * total_connections. A client over the limit is closed right after its
+ * accept and counted as rejected. Startup raises RLIMIT_NOFILE to fit.
+ */
+uint32_t max_conn = DEFAULT_MAX_CONN;
+uint32_t total_connections;
+
+/*
+ * With -q each ring gets a kernel SQ thread that picks up SQEs on its own,
+ * so submitting only enters the kernel to wake it after sq_idle ms without
+ * work. With -C cpu, worker i's loop thread runs on cpu + 2i and its SQ
+ * thread on cpu + 2i + 1 (cpu + i for the loop alone without -q), modulo the
+ * online CPUs.
+ */
+uint8_t sqpoll;
+uint32_t sq_idle = DEFAULT_SQ_IDLE;
+int pin_cpu = -1;
+
+/*
+ * Bytes received but not yet written to disk. Each worker may hold its
+ * share of mem_budget, each connection at most conn_budget (0: no limit).
+ * A connection over either stops reading until its worker's writes drain,
+ * which keeps the wake-ups local to the worker. The check happens before a
+ * read is armed, so the limits can be overshot by one read per connection.
+ */
+uint64_t mem_budget = DEFAULT_MEM_BUDGET;
+uint64_t conn_budget;
+uint64_t worker_budget;
+uint64_t buffered_bytes;
+uint64_t buffered_peak;
 pthread_t thread;
 
+/*
+ * A connection whose socket has a read or splice armed for longer than
+ * idle_timeout (nothing being uploaded) or stall_timeout (in the middle of
+ * an upload) is shut down and its partial file removed, unless the upload
+ * is resumable, 0 disables either.
+ * Connections held back by the server itself (deferred, starved for
+ * buffers, draining the pipe) never time out.
+ */
+uint64_t idle_timeout = DEFAULT_IDLE_TIMEOUT * 1000000000ULL;
+uint64_t stall_timeout = DEFAULT_STALL_TIMEOUT * 1000000000ULL;
+
+/*
+ * When an upload counts as stored. With DURABILITY_NONE it is once its last
+ * write completed, with DURABILITY_EOF once an fdatasync queued right then
+ * completed, and with DURABILITY_GROUP the files completed within
+ * group_commit_ms are synced together when the window closes. Under either
+ * sync policy, writeback of a long upload is started every SYNC_CHUNK bytes
+ * so the final sync has little left to flush. Framed uploads are confirmed
+ * to the client with a FRAME_TYPE_ACK frame once stored.
+ */
+uint8_t durability = DURABILITY_NONE;
+uint32_t group_commit_ms = DEFAULT_GROUP_COMMIT_MS;
+
+/*
+ * Uploads announcing at least direct_threshold bytes (0: none) bypass the
+ * page cache. Their payload is received into DIRECT_CHUNK staging chunks
+ * carved out of each worker's share of arena_size, hugepage-backed if the
+ * system has them and registered with the ring, and every full chunk goes
+ * out as one O_DIRECT IORING_OP_WRITE_FIXED. The unaligned tail is written
+ * through the page cache at eof.
+ */
+uint64_t direct_threshold;
+uint64_t arena_size = DEFAULT_ARENA;
+
+/*
+ * Every upload is digested as its bytes pass through the read or staging
+ * buffers, with the algorithm its frame asks for or else default_digest.
+ * A digested upload is never spliced, its bytes have to be seen. Once
+ * stored, the digest is written next to it as <name>.crc32c or
+ * <name>.sha256, and checked against the one the client sent, if any.
+ */
+uint8_t default_digest = DIGEST_NONE;
+
+/*
+ * With -B dedup, uploads are cut into content-defined chunks as they are
+ * received and each file is stored as a manifest of them, see chunkstore.h.
+ * A chunk is only written if chunk_index does not have it yet. The index
+ * is shared by the workers under chunk_lock, open addressing on the first
+ * 8 bytes of the SHA-256, loaded from the store at startup, and a chunk
+ * only goes in once it is renamed to its name. gear comes from a fixed
+ * seed, chunk boundaries have to stay the same from run to run.
+ */
+uint8_t backend = BACKEND_PLAIN;
+uint64_t gear[256];
+uint8_t (*chunk_index)[SHA256_LEN];
+uint64_t chunk_index_cap;
+uint64_t chunk_index_count;
+pthread_mutex_t chunk_lock = PTHREAD_MUTEX_INITIALIZER;
+int chunk_dir_fd = -1;
+
+/*
+ * A chunk being written, hashed on the first byte of its SHA-256 into
+ * chunks_pending under chunk_lock. An upload that cuts the same chunk
+ * meanwhile does not write it again but waits on it: a request holding a
+ * write of its file goes on waiters, chained through next_pending, with
+ * its worker's id in client_socket. The worker that stores the chunk hands
+ * each one back to its worker once the chunk is renamed, or lost with it.
+ */
+typedef struct chunk_pending {
+    struct chunk_pending *next;
+    uint8_t key[SHA256_LEN];
+    struct request *waiters;
+} chunk_pending;
+
+chunk_pending *chunks_pending[CHUNK_PENDING_BUCKETS];
+
+/*
+ * A resumable upload (FRAME_FLAG_RESUME) is written to <name>.part and
+ * renamed to <name> once stored. Its progress is kept in the RESUME_XATTR
+ * extended attribute of the .part file as a resume_record, set right after
+ * an fdatasync covering durable bytes: whenever nothing is in flight and
+ * RESUME_CHECKPOINT bytes were written since the last record, and when the
+ * upload is cut short. A record only counts for the same content ID and
+ * size, anything else starts the .part over. The deduplicating backend
+ * does not resume, its uploads always start at 0.
+ */
+struct resume_record {
+    uint8_t id[FRAME_RESUME_ID_SZ];
+    uint64_t size;              /* little-endian, as the frames */
+    uint64_t durable;
+} __attribute__((packed));
+
+/*
+ * A file uploaded as FRAME_FLAG_STRIPE ranges, over connections that may
+ * belong to several workers. Each range is an upload of its own, written
+ * through its own fd at its offset into path, .stripe.<ID in hex> in the
+ * client's directory. Files in transfer are on the stripes list under
+ * stripe_lock, held by their range uploads. A range lands once stored,
+ * ranges keeps the landed ones sorted and merged, so a range sent twice
+ * counts once. The range that completes the file renames it to its name
+ * before its ack goes out. A file left unfinished by every connection
+ * stays on the list, so ranges sent later still count, up to STRIPE_KEEP
+ * of them, the oldest forgotten first; its path stays like any partial
+ * upload.
+ */
+typedef struct stripe {
+    struct stripe *next;
+    uint32_t addr;
+    uint8_t id[FRAME_RESUME_ID_SZ];
+    uint64_t size;
+    uint32_t refs;              /* range uploads in progress */
+    uint8_t done;               /* off the list, every byte landed */
+    uint32_t ranges_len;
+    uint32_t ranges_cap;
+    uint64_t (*ranges)[2];      /* [start, end) */
+    uint64_t landed;
+    char name[FRAME_NAME_MAX + 1];
+    char path[sizeof(STRIPE_PREFIX) + 2 * FRAME_RESUME_ID_SZ];
+} stripe;
+
+stripe *stripes;
+uint32_t stripe_count;
+pthread_mutex_t stripe_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Chunking state of a deduplicated upload. buf, a staging chunk, collects
+ * the current chunk, fill bytes of it so far, and hash is the Gear hash
+ * over them. lines holds manifest lines not written yet. bytes counts the
+ * payload, off only counts the manifest. lost is set if a chunk could not
+ * be stored, the upload then is not either.
+ */
+typedef struct cdc_state {
+    uint8_t *buf;
+    uint32_t fill;
+    uint64_t hash;
+    uint64_t bytes;
+    uint8_t lost;
+    uint32_t lines_len;
+    char *lines;
+} cdc_state;
+
+/*
+ * A file being uploaded. The connection and every write in flight hold a
+ * reference, so the fd is only closed once the last queued write is done.
+ * Every write is positioned at off, which then moves past it, so writes
+ * may complete in any order. The uploading connection stops reading while
+ * write_depth writes are in flight.
+ */
+typedef struct upload_file {
+    int fd;
+    uint8_t fixed;
+    uint32_t refs;
+    uint32_t inflight;
+    uint64_t off;
+    uint64_t opened;            /* ns, for the transfer duration */
+    uint64_t signature;         /* of the uploading connection, for the logs */
+    /*
+     * The file is opened with IORING_OP_OPENAT relative to its client's
+     * directory, which may itself still be opening. Until the open
+     * completes, which holds a reference, writes wait on pending in queue
+     * order; they cover [base, off). If it fails they are dropped. waiter is the
+     * connection holding its reads until then.
+     */
+    uint8_t opening;
+    uint8_t failed;
+    uint8_t write_failed;       /* a write to it failed, it is not stored */
+    /*
+     * complete is set once the whole upload was received, ack_conn then
+     * holds a pending ack on its connection. size is the announced size, to
+     * preallocate. written is the offset the completed bytes reach from
+     * where the upload started, base or the resume offset, writeback was
+     * started up to kicked.
+     */
+    uint8_t complete;
+    struct connection *ack_conn;
+    uint64_t size;
+    uint64_t written;
+    uint64_t kicked;
+    uint64_t done_at;           /* ns the last write completed */
+    /*
+     * A direct upload fills stage up to stage_fill before writing it at off.
+     * odirect is cleared if the filesystem refuses O_DIRECT, the chunks are
+     * then written through the page cache. tail holds the last tail_len
+     * bytes, short of DIRECT_ALIGN, until every chunk write completed.
+     */
+    uint8_t direct;
+    uint8_t odirect;
+    uint32_t stage_fill;
+    uint32_t tail_len;
+    uint8_t *stage;
+    char *tail;
+    /* sum is final once complete is set, digest_bad if the client's differed */
+    uint8_t digest_bad;
+    uint8_t sum[DIGEST_MAX];
+    struct digest_state digest;
+    cdc_state *cdc;             /* NULL unless deduplicated */
+    /*
+     * resume is one of RESUME_, path the name on disk, which is name or
+     * <name>.part. checkpointed bytes are in the last record written,
+     * checkpointing is set while one is being written.
+     */
+    uint8_t resume;
+    uint8_t checkpointing;
+    uint8_t checkpoint_failed;
+    uint8_t resume_id[FRAME_RESUME_ID_SZ];
+    uint64_t checkpointed;
+    const char *path;
+    /*
+     * A range of a striped upload writes from base on, a plain upload from
+     * 0. landed is set once its range was counted, stripe_landed then has
+     * the bytes of the file landed so far, for the ack.
+     */
+    stripe *stripe;
+    uint64_t base;
+    uint8_t landed;
+    uint64_t stripe_landed;
+    struct upload_file *next_sync;
+    struct dir_entry *dir;
+    struct connection *waiter;
+    struct request *pending_head;
+    struct request *pending_tail;
+    struct upload_file *next_waiting;
+    char name[];                /* relative to dir */
+} upload_file;
+
+/*
+ * The davy_jones_locker/<ip> directory of a client, created with
+ * IORING_OP_MKDIRAT and held open as an O_PATH fd so files are opened
+ * relative to it. Each worker caches its entries by address: connections
+ * and files hold references, and up to DIR_CACHE_IDLE unused ones stay
+ * open, least recently used evicted first, so a reconnecting client does
+ * not touch the directory again.
+ */
+typedef struct dir_entry {
+    uint32_t addr;
+    int fd;                     /* -1 while opening */
+    uint8_t failed;
+    uint32_t refs;
+    upload_file *waiting;       /* files to open once fd is known */
+    struct dir_entry *next;     /* hash chain */
+    struct dir_entry *idle_prev;
+    struct dir_entry *idle_next;
+    char path[CONN_FOLDER_SZ];
+} dir_entry;
+
 typedef struct request {
     int event_type;
     int iovec_count;
-    int client_socket;
-    uint64_t signature;
+    union {
+        int client_socket;
+        uint32_t done;          /* of a file write, bytes of iov[0] written */
+    };
+    int buf_id;
+    struct connection *conn;
+    struct upload_file *file;
+    uint64_t read_at;           /* ns the data of a file write was read */
+    union {
+        struct broadcast *broadcast;
+        struct request *next_pending;   /* file writes waiting for the open */
+        struct dir_entry *dir;
+        uint64_t off;                   /* a submitted file write, where iov[0] goes */
+    };
     struct iovec iov[];
 } request;
 
-typedef struct connection {
-    uint32_t sockfd;
+/*
+ * Requests carrying at most one iovec are carved out of a preallocated slab
+ * and kept on a LIFO free list, so the most recently completed (cache-hot)
+ * slot is reused first. Bigger requests, or an exhausted slab, fall back to
+ * the heap. Each worker owns its pool and only touches it from its own loop.
+ */
+struct request_pool {
+    uint8_t *slab;
+    uint8_t *slab_end;
+    struct request *free_list;
+    uint32_t size;
+    uint32_t in_use;
+    uint32_t high_water;
+    uint64_t misses;
+};
+
+/*
+ * The state a connection needs on every completion is kept in connection,
+ * which fits two cache lines. What only logging, opening a file or parsing
+ * a frame header touches lives in its conn_cold, so tens of thousands of
+ * mostly idle connections keep a small working set.
+ */
+typedef struct conn_cold {
     uint64_t signature;
-    uint32_t filefd;
-    clock_t start;
+    uint64_t pipe_filled_at;
+    dir_entry *dir;
+    /* The header, the name, then a digest, a content ID or a frame_stripe */
+    char frame_buf[sizeof(struct frame_header) + FRAME_NAME_MAX + DIGEST_MAX];
+} conn_cold;
+
+typedef struct connection {
+    uint32_t sockfd;            /* a registered file index with -f */
+    uint32_t slot;
+    struct upload_file *file;
+    conn_cold *cold;
     uint8_t isFileTransferring;
-    char containedFolder[0x100];
+    uint8_t closed;
+    uint8_t draining;           /* the client finished sending, acks are still due */
+    uint8_t read_deferred;      /* DEFER_, why its next read waits */
+    /*
+     * read_armed is set while a read or splice waits on the socket, armed at
+     * waiting_since. The connection sits on one timer wheel slot list.
+     */
+    uint8_t read_armed;
+    /* Incremental parser state of the framed protocol */
+    uint8_t proto;
+    uint8_t frame_state;
+    uint16_t frame_have;
+    /*
+     * Disk writes of this connection's data still in flight and the bytes
+     * they hold, and uploads waiting to be confirmed. A closed connection
+     * is only freed once they are done.
+     */
+    uint32_t writes_inflight;
+    uint32_t acks_pending;
+    /*
+     * When the upload header announces the payload size, that many bytes
+     * bypass the read buffers: they are moved socket -> pipe -> file with
+     * splice and never reach user space, or for a direct upload received
+     * straight into its staging chunk. While splice_remaining is set no
+     * buffered read is armed on the socket.
+     */
+    uint32_t pipe_pending;
+    uint64_t buffered;
+    int pipefd[2];
+    uint64_t splice_remaining;
+    uint64_t frame_remaining;
+    uint64_t waiting_since;
+    struct connection *next_starved;
+    struct connection *next_deferred;
+    struct connection *wheel_next;
+    struct connection **wheel_prev;
 } connection;
 
-struct io_uring ring;
+/*
+ * One event of a worker, formatted as a JSON line by the log thread. what
+ * points at a string literal, ts is the CLOCK_MONOTONIC time of the batch.
+ */
+typedef struct log_record {
+    uint64_t ts;
+    uint64_t signature;
+    uint64_t bytes;
+    uint64_t duration;          /* ns */
+    const char *what;
+    uint32_t addr;
+    int32_t err;                /* errno, 0 for none */
+    uint8_t type;
+    uint8_t stored;
+    char name[LOG_NAME_SZ];
+} log_record;
+
+struct histogram {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[HIST_BUCKETS];
+};
+
+/*
+ * A console command, sent as is by every socket write broadcasting it. All
+ * workers take and drop references, so refs is atomic, and the last write
+ * to complete frees it.
+ */
+typedef struct broadcast {
+    uint32_t refs;
+    uint32_t len;
+    uint64_t queued;            /* ns, for the fan-out latency */
+    char text[];
+} broadcast;
+
+/*
+ * A message queued for one worker: a broadcast from the input thread, or
+ * from another worker a chunk wait of this one that ended, lost if the
+ * chunk could not be stored.
+ */
+typedef struct command {
+    struct command *next;
+    broadcast *payload;
+    struct request *waiter;
+    uint8_t lost;
+} command;
+
+/*
+ * Every worker thread runs its own server_loop on its own ring and its own
+ * SO_REUSEPORT listening socket, so the kernel spreads new connections across
+ * workers and a connection is only ever touched by the worker that accepted
+ * it. Nothing on the data path is shared between workers.
+ */
+typedef struct worker {
+    uint32_t id;
+    pthread_t thread;
+    int server_socket;
+    struct io_uring ring;
+
+    /*
+     * Connections live at a fixed slot of conns_list for their whole lifetime
+     * and requests carry a pointer to their connection, so completions never
+     * search the table. Unused slots are kept on a stack. The table starts at
+     * CONN_TABLE_MIN slots and doubles when the stack runs empty, moving only
+     * the pointers.
+     */
+    connection **conns_list;
+    uint32_t *free_slots;
+    uint32_t conns_cap;
+    uint32_t free_slots_top;
+    uint32_t curr_connection;
+    uint32_t conns_peak;
+    uint64_t conns_rejected;
+
+    /*
+     * Socket reads pick their destination from a ring of preallocated buffers
+     * (IOSQE_BUFFER_SELECT), so no memory is allocated or cleared per read. A
+     * buffer stays out of the ring while the read handler or any disk write
+     * still uses it, buf_refs counts those users. Connections whose read
+     * found the ring empty wait on the starved list until a buffer comes back.
+     */
+    struct io_uring_buf_ring *buf_ring;
+    uint8_t *buf_pool;
+    uint32_t *buf_refs;
+    uint32_t buf_available;
+    connection *starved_head;
+    connection *starved_tail;
+
+    /*
+     * Connections waiting for writes to drain before their next read. One
+     * over its own limits waits for its own writes, one only held back by
+     * worker_budget waits in line here, oldest first.
+     */
+    connection *deferred_head;
+    connection *deferred_tail;
+    uint64_t buffered;
+    uint64_t buffered_peak;
+
+    struct request_pool req_pool;
+
+    /*
+     * Hashed timer wheel of WHEEL_SLOTS slots of WHEEL_TICK_NS. A connection
+     * is filed under the tick of its earliest possible deadline, and a tick
+     * only looks at its own slot: connections not due yet, because they
+     * read since or the deadline is more than a turn of the wheel away, are
+     * filed again. Reads never touch the wheel, they only stamp
+     * waiting_since. wheel_tick is the next tick to process, tick_ts the
+     * period of the timeout request driving it.
+     */
+    connection *wheel[WHEEL_SLOTS];
+    uint64_t wheel_tick;
+    struct __kernel_timespec tick_ts;
+    uint64_t idle_expired;
+    uint64_t stall_expired;
+
+    dir_entry *dir_buckets[DIR_BUCKETS];
+    dir_entry *dir_idle_head;   /* least recently used */
+    dir_entry *dir_idle_tail;
+    uint32_t dirs_idle;
+    uint64_t dir_hits;
+    uint64_t dir_misses;
+
+    /* Files waiting for the group commit window armed with group_ts to close */
+    upload_file *sync_head;
+    uint32_t sync_queued;
+    uint8_t group_armed;
+    struct __kernel_timespec group_ts;
+    uint64_t syncs;
+    uint64_t sync_errors;
+    uint64_t write_errors;
+    uint64_t acks;
+
+    /*
+     * Staging arena of direct uploads, arena_chunks chunks kept on a stack of
+     * free indices. When it runs dry chunks come from the heap, those are
+     * written with plain writes. arena_registered tells whether the arena is
+     * registered as fixed buffer 0.
+     */
+    uint8_t *arena;
+    size_t arena_len;
+    uint32_t arena_chunks;
+    uint32_t *stage_free;
+    uint32_t stage_free_top;
+    uint8_t arena_huge;
+    uint8_t arena_registered;
+    uint64_t stage_misses;
+    uint64_t direct_uploads;
+    uint64_t direct_writes;
+    uint64_t fixed_writes;
+    uint64_t tail_writes;
+
+    uint64_t digested_bytes;
+    uint64_t digest_mismatches;
+    uint64_t sidecars;
+
+    uint64_t chunks_new;
+    uint64_t chunks_dup;
+    uint64_t chunk_bytes_new;
+    uint64_t chunk_bytes_dup;
+    uint64_t chunk_errors;
+
+    uint64_t resumable;
+    uint64_t resumed;
+    uint64_t resumed_bytes;
+    uint64_t checkpoints;
+    uint64_t checkpoint_errors;
+    uint64_t stripe_ranges;
+    uint64_t stripe_files;
+
+    /* Peer addresses of the armed direct accepts and free upload file slots */
+    struct sockaddr_in accept_addrs[ACCEPT_BATCH];
+    socklen_t accept_addr_lens[ACCEPT_BATCH];
+    uint32_t file_slots[FIXED_FILE_SLOTS];
+    uint32_t file_slots_top;
+
+    /*
+     * Commands from the input thread and other workers are pushed on
+     * mailbox, a lock-free stack: producers CAS a node on top and the
+     * worker takes the whole list with one exchange. The push that finds it
+     * empty wakes the worker through event_fd, which it keeps a read armed
+     * on, so only the worker ever touches its ring.
+     */
+    int event_fd;
+    uint64_t event_val;
+    command *mailbox;
+
+    /* io_uring_enter() calls made by this worker and bytes it received */
+    uint64_t enter_calls;
+    uint64_t sq_full_events;
+    uint64_t bytes_read;
+    uint64_t bytes_spliced;
+    uint64_t reads_deferred;
+
+    /*
+     * Live metrics. Only this worker's loop writes them, with plain stores,
+     * and the stats thread reads them while it runs, so a dump may be a few
+     * events behind. now is taken once per CQE batch and timestamps every
+     * completion in it.
+     */
+    uint64_t now;
+    uint64_t cqes[EVENT_TYPE_COUNT];
+    uint64_t bytes_written;
+    struct histogram batch_hist;        /* CQEs handled per loop iteration */
+    struct histogram write_lat_hist;    /* ns from a read to the disk write of its data */
+    struct histogram transfer_hist;     /* ns from opening a file to its last write */
+    struct histogram fanout_hist;       /* ns from queueing a broadcast to its last write */
+    struct histogram sync_hist;         /* ns from a file's last write to its sync completing */
+    struct histogram group_hist;        /* files synced per group commit */
+
+    /*
+     * Log records go to log_ring, a single producer single consumer ring:
+     * this worker fills the slot at log_head and publishes it by moving
+     * log_head, the log thread formats slots up to there and moves log_tail
+     * past them. A full ring drops the record, the loop never waits.
+     */
+    log_record *log_ring;
+    uint32_t log_head;
+    uint64_t log_dropped;
+    uint32_t log_tail __attribute__((aligned(64)));
+} worker;
+
 struct io_uring_params params;
 
-connection *conns_list[MAX_CONN];
+worker *workers;
+uint32_t worker_count;
+uint32_t buf_count = DEFAULT_BUF_COUNT;
+uint32_t buf_size = READ_SZ;
+uint32_t req_pool_size = DEFAULT_REQ_POOL_SIZE;
+
+/*
+ * The signature only identifies a connection in logs. It comes from a
+ * counter shared by all workers, so a reused ip:port or slot still gets a
+ * new one.
+ */
+uint64_t next_signature;
+
+/*
+ * Workers never print on their own, their log records are written as JSON
+ * lines to log_path (stderr if NULL) by log_thread every LOG_FLUSH_MS, in
+ * batches of up to LOG_BATCH bytes. real_offset turns CLOCK_MONOTONIC
+ * stamps into wall-clock time.
+ */
+const char *log_path;
+int log_fd = STDERR_FILENO;
+pthread_t log_thread;
+pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+int64_t real_offset;
+const char *log_names[] = { "open", "transfer", "close", "timeout", "error" };
+
+/* Metrics are dumped on SIGUSR1 and SIGINT, and to anyone connecting to stats_path */
+const char *stats_path;
+int stats_socket = -1;
+int signal_fd;
+pthread_t stats_thread;
+const char *event_names[EVENT_TYPE_COUNT] = {
+    "accept", "read", "write", "control", "splice_in", "splice_out",
+    "tick", "shutdown", "unlink", "mkdir", "open_dir", "open_file",
+    "fallocate", "sync_range", "fsync", "group_commit", "ack", "stage_in",
+    "stage_out", "sidecar_open", "sidecar_write", "sidecar_close", "chunk_open",
+    "chunk_write", "chunk_sync", "chunk_rename", "chunk_close", "manifest",
+    "resume_read", "checkpoint_sync", "checkpoint", "part_rename", "close_slot"
+};
 
 /*
  One function that prints the system call and the error details
@@ -74,6 +841,369 @@ void *zh_malloc(size_t size) {
     return buf;
 }
 
+void *zh_realloc(void *ptr, size_t size) {
+    void *buf = realloc(ptr, size);
+    if (!buf) {
+        fprintf(stderr, "Fatal error: unable to allocate memory.\n");
+        exit(1);
+    }
+    return buf;
+}
+
+uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+uint32_t hist_bucket(uint64_t value)
+{
+    if (value < HIST_SUB) return value;
+    int msb = 63 - __builtin_clzll(value);
+    return ((msb - HIST_SUB_BITS + 1) << HIST_SUB_BITS) +
+           ((value >> (msb - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+/* Highest value recorded into bucket */
+uint64_t hist_bucket_top(uint32_t bucket)
+{
+    if (bucket < HIST_SUB) return bucket;
+    uint32_t shift = (bucket >> HIST_SUB_BITS) - 1;
+    uint64_t base = (uint64_t)(HIST_SUB | (bucket & (HIST_SUB - 1))) << shift;
+    return base + ((uint64_t)1 << shift) - 1;
+}
+
+void hist_record(struct histogram *h, uint64_t value)
+{
+    ++h->count;
+    h->sum += value;
+    if (value > h->max) h->max = value;
+    ++h->buckets[hist_bucket(value)];
+}
+
+void hist_merge(struct histogram *into, const struct histogram *h)
+{
+    into->count += h->count;
+    into->sum += h->sum;
+    if (h->max > into->max) into->max = h->max;
+    for (uint32_t i = 0; i < HIST_BUCKETS; ++i)
+        into->buckets[i] += h->buckets[i];
+}
+
+uint64_t hist_percentile(const struct histogram *h, double pct)
+{
+    uint64_t rank = (uint64_t)(h->count * pct / 100), seen = 0;
+    for (uint32_t i = 0; i < HIST_BUCKETS; ++i) {
+        seen += h->buckets[i];
+        if (seen > rank)
+            return hist_bucket_top(i) < h->max ? hist_bucket_top(i) : h->max;
+    }
+    return h->max;
+}
+
+/* Prints count, mean and percentiles, values divided by unit */
+void print_histogram(int out, const char *name, const struct histogram *h, double unit)
+{
+    dprintf(out, "  %s: count %lu", name, h->count);
+    if (h->count)
+        dprintf(out, ", mean %.1f, p50 %.1f, p90 %.1f, p99 %.1f, p99.9 %.1f, max %.1f",
+                h->sum / unit / h->count, hist_percentile(h, 50) / unit,
+                hist_percentile(h, 90) / unit, hist_percentile(h, 99) / unit,
+                hist_percentile(h, 99.9) / unit, h->max / unit);
+    dprintf(out, "\n");
+}
+
+/* A cleared record for the caller to fill and log_commit, or NULL if the ring is full */
+log_record *log_begin(worker *w, uint8_t type)
+{
+    if (w->log_head - __atomic_load_n(&w->log_tail, __ATOMIC_ACQUIRE) == LOG_RING_SZ) {
+        ++w->log_dropped;
+        return 0x0;
+    }
+    log_record *rec = &w->log_ring[w->log_head & (LOG_RING_SZ - 1)];
+    memset(rec, 0, offsetof(log_record, name) + 1);
+    rec->type = type;
+    rec->ts = w->now;
+    return rec;
+}
+
+void log_commit(worker *w)
+{
+    __atomic_store_n(&w->log_head, w->log_head + 1, __ATOMIC_RELEASE);
+}
+
+void log_conn(worker *w, uint8_t type, connection *conn, const char *what, int err)
+{
+    log_record *rec = log_begin(w, type);
+    if (!rec) return;
+    rec->signature = conn->cold->signature;
+    rec->addr = conn->cold->dir->addr;
+    rec->what = what;
+    rec->err = err;
+    log_commit(w);
+}
+
+/* Payload bytes of an upload, a deduplicated one only writes its manifest at off */
+uint64_t upload_bytes(upload_file *file)
+{
+    return file->cdc ? file->cdc->bytes : file->off - file->base;
+}
+
+/*
+ * An event of file. A transfer record carries its size and the time from
+ * starting the open to the file being stored, or given up.
+ * */
+
+void log_file(worker *w, uint8_t type, upload_file *file, const char *what, int err)
+{
+    log_record *rec = log_begin(w, type);
+    if (!rec) return;
+    rec->signature = file->signature;
+    rec->addr = file->dir->addr;
+    rec->what = what;
+    rec->err = err;
+    if (type == LOG_TRANSFER) {
+        rec->bytes = upload_bytes(file);
+        rec->duration = w->now - file->opened;
+        rec->stored = !what;
+    }
+    strncpy(rec->name, file->name, LOG_NAME_SZ - 1);
+    log_commit(w);
+}
+
+/* Appends s to out as the body of a JSON string, returns the length written */
+int json_escape(char *out, const char *s)
+{
+    char *p = out;
+    for (; *s; ++s) {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\') {
+            *p++ = '\\';
+            *p++ = c;
+        } else if (c < 0x20 || c >= 0x7f) {
+            p += sprintf(p, "\\u%04x", c);
+        } else {
+            *p++ = c;
+        }
+    }
+    return p - out;
+}
+
+/* Formats rec as one JSON line into out, at most LOG_LINE_MAX bytes */
+int format_record(char *out, uint32_t worker_id, const log_record *rec)
+{
+    int64_t real = (int64_t)rec->ts + real_offset;
+    int len = sprintf(out, "{\"time\":%ld.%06ld,\"worker\":%u,\"event\":\"%s\"",
+                      real / 1000000000, real % 1000000000 / 1000, worker_id, log_names[rec->type]);
+    if (rec->signature)
+        len += sprintf(out + len, ",\"client\":\"%lx\"", rec->signature);
+    if (rec->addr)
+        len += sprintf(out + len, ",\"ip\":\"%u.%u.%u.%u\"", rec->addr & 0xff, (rec->addr >> 8) & 0xff,
+                       (rec->addr >> 16) & 0xff, rec->addr >> 24);
+    if (rec->name[0]) {
+        len += sprintf(out + len, ",\"file\":\"");
+        len += json_escape(out + len, rec->name);
+        out[len++] = '"';
+    }
+    if (rec->type == LOG_TRANSFER) {
+        double secs = rec->duration / 1e9;
+        len += sprintf(out + len, ",\"bytes\":%lu,\"duration_us\":%.1f,\"mb_s\":%.2f,\"stored\":%s",
+                       rec->bytes, rec->duration / 1e3, secs > 0 ? rec->bytes / secs / 1e6 : 0.0,
+                       rec->stored ? "true" : "false");
+    }
+    if (rec->what)
+        len += sprintf(out + len, ",\"%s\":\"%s\"", rec->type == LOG_TIMEOUT ? "reason" : "what", rec->what);
+    if (rec->err)
+        len += sprintf(out + len, ",\"error\":\"%s\"", strerror(rec->err));
+    len += sprintf(out + len, "}\n");
+    return len;
+}
+
+void write_all(int fd, const char *buf, size_t len)
+{
+    while (len) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0 && errno == EINTR) continue;
+        /* Nowhere to report it, the records are lost */
+        if (n <= 0) return;
+        buf += n;
+        len -= n;
+    }
+}
+
+/* Writes out every record published so far, one write per LOG_BATCH bytes */
+void flush_logs()
+{
+    static char buf[LOG_BATCH];
+    size_t len = 0;
+    pthread_mutex_lock(&log_lock);
+    for (uint32_t i = 0; workers && i < worker_count; ++i) {
+        worker *w = &workers[i];
+        uint32_t head = __atomic_load_n(&w->log_head, __ATOMIC_ACQUIRE);
+        for (uint32_t tail = w->log_tail; tail != head; ++tail) {
+            if (len > LOG_BATCH - LOG_LINE_MAX) {
+                write_all(log_fd, buf, len);
+                len = 0;
+            }
+            len += format_record(buf + len, w->id, &w->log_ring[tail & (LOG_RING_SZ - 1)]);
+            __atomic_store_n(&w->log_tail, tail + 1, __ATOMIC_RELEASE);
+        }
+    }
+    if (len) write_all(log_fd, buf, len);
+    pthread_mutex_unlock(&log_lock);
+}
+
+void *log_loop(void *args)
+{
+    struct timespec period = { 0, LOG_FLUSH_MS * 1000000L };
+    while (1) {
+        flush_logs();
+        nanosleep(&period, NULL);
+    }
+    return 0x0;
+}
+
+void setup_logs()
+{
+    struct timespec mono, real;
+    if (log_path) {
+        log_fd = open(log_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (log_fd < 0) fatal_error("open() log");
+    }
+    clock_gettime(CLOCK_MONOTONIC, &mono);
+    clock_gettime(CLOCK_REALTIME, &real);
+    real_offset = ((int64_t)real.tv_sec - mono.tv_sec) * 1000000000 + real.tv_nsec - mono.tv_nsec;
+}
+
+void setup_request_pool(struct request_pool *pool)
+{
+    _Static_assert(sizeof(struct request) + sizeof(struct iovec) <= REQ_SLOT_SZ,
+                   "request slot too small");
+    pool->size = req_pool_size;
+    if (posix_memalign((void **)&pool->slab, REQ_SLOT_SZ, (size_t)pool->size * REQ_SLOT_SZ))
+        fatal_error("posix_memalign()");
+    pool->slab_end = pool->slab + (size_t)pool->size * REQ_SLOT_SZ;
+    pool->free_list = 0x0;
+    for (uint32_t i = pool->size; i-- > 0;) {
+        struct request *req = (struct request *)(pool->slab + (size_t)i * REQ_SLOT_SZ);
+        *(struct request **)req = pool->free_list;
+        pool->free_list = req;
+    }
+}
+
+struct request *alloc_request(worker *w, int iovec_count)
+{
+    struct request_pool *pool = &w->req_pool;
+    struct request *req;
+    if (iovec_count <= 1 && pool->free_list) {
+        req = pool->free_list;
+        pool->free_list = *(struct request **)req;
+        if (++pool->in_use > pool->high_water)
+            pool->high_water = pool->in_use;
+    } else {
+        if (iovec_count <= 1) ++pool->misses;
+        req = zh_malloc(sizeof(*req) + iovec_count * sizeof(struct iovec));
+    }
+    req->iovec_count = iovec_count;
+    req->buf_id = -1;
+    req->conn = 0x0;
+    req->file = 0x0;
+    return req;
+}
+
+void free_request(worker *w, struct request *req)
+{
+    struct request_pool *pool = &w->req_pool;
+    if ((uint8_t *)req >= pool->slab && (uint8_t *)req < pool->slab_end) {
+        *(struct request **)req = pool->free_list;
+        pool->free_list = req;
+        --pool->in_use;
+    } else {
+        free(req);
+    }
+}
+
+void print_worker_stats(int out, worker *w)
+{
+    dprintf(out, "worker %u: %u connections, peak %u, rejected %lu, table %u slots\n",
+            w->id, w->curr_connection, w->conns_peak, w->conns_rejected, w->conns_cap);
+    dprintf(out, "  request pool: size %u, in use %u, high water %u, heap fallbacks %lu\n",
+            w->req_pool.size, w->req_pool.in_use, w->req_pool.high_water, w->req_pool.misses);
+    uint64_t bytes = w->bytes_read + w->bytes_spliced;
+    dprintf(out, "  io_uring_enter calls %lu, SQ full %lu, bytes read %lu, bytes spliced %lu, bytes written %lu, %.2f calls per MiB\n",
+            w->enter_calls, w->sq_full_events, w->bytes_read, w->bytes_spliced, w->bytes_written,
+            bytes ? (double)w->enter_calls * 1048576 / bytes : 0.0);
+    dprintf(out, "  buffered bytes %lu, peak %lu, reads deferred %lu\n",
+            w->buffered, w->buffered_peak, w->reads_deferred);
+    dprintf(out, "  timed out: idle %lu, stalled %lu\n", w->idle_expired, w->stall_expired);
+    dprintf(out, "  directory cache: hits %lu, misses %lu, idle %u\n", w->dir_hits, w->dir_misses, w->dirs_idle);
+    dprintf(out, "  syncs %lu, sync errors %lu, write errors %lu, acks %lu\n",
+            w->syncs, w->sync_errors, w->write_errors, w->acks);
+    if (w->arena)
+        dprintf(out, "  direct uploads %lu, chunk writes %lu (fixed %lu), tail writes %lu, arena %u/%u chunks free%s, heap chunks %lu\n",
+                w->direct_uploads, w->direct_writes, w->fixed_writes, w->tail_writes, w->stage_free_top,
+                w->arena_chunks, w->arena_huge ? " (hugepages)" : "", w->stage_misses);
+    dprintf(out, "  digested bytes %lu, digest mismatches %lu, sidecars %lu\n",
+            w->digested_bytes, w->digest_mismatches, w->sidecars);
+    if (backend == BACKEND_DEDUP)
+        dprintf(out, "  chunks stored %lu (%lu bytes), duplicate %lu (%lu bytes), chunk errors %lu\n",
+                w->chunks_new, w->chunk_bytes_new, w->chunks_dup, w->chunk_bytes_dup, w->chunk_errors);
+    dprintf(out, "  resumable uploads %lu, resumed %lu (%lu bytes not sent again), checkpoints %lu, checkpoint errors %lu\n",
+            w->resumable, w->resumed, w->resumed_bytes, w->checkpoints, w->checkpoint_errors);
+    dprintf(out, "  striped ranges %lu, striped files completed %lu\n", w->stripe_ranges, w->stripe_files);
+    dprintf(out, "  log records %u, dropped %lu\n", w->log_head, w->log_dropped);
+    dprintf(out, "  cqes");
+    for (int type = 0; type < EVENT_TYPE_COUNT; ++type)
+        dprintf(out, " %s %lu", event_names[type], w->cqes[type]);
+    dprintf(out, "\n");
+    print_histogram(out, "cqe batch", &w->batch_hist, 1);
+    print_histogram(out, "read to write done (us)", &w->write_lat_hist, 1e3);
+    print_histogram(out, "transfer (ms)", &w->transfer_hist, 1e6);
+    print_histogram(out, "broadcast fan-out (us)", &w->fanout_hist, 1e3);
+    print_histogram(out, "last write to synced (us)", &w->sync_hist, 1e3);
+    print_histogram(out, "files per group commit", &w->group_hist, 1);
+}
+
+/* Every worker, then the histograms merged over all of them */
+void print_stats(int out)
+{
+    struct histogram *total = calloc(6, sizeof(*total));
+    uint64_t connections = 0, rejected = 0, chunked = 0, stored = 0;
+    for (uint32_t i = 0; i < worker_count; ++i) {
+        worker *w = &workers[i];
+        print_worker_stats(out, w);
+        connections += w->curr_connection;
+        rejected += w->conns_rejected;
+        chunked += w->chunk_bytes_new + w->chunk_bytes_dup;
+        stored += w->chunk_bytes_new;
+        if (!total) continue;
+        hist_merge(&total[0], &w->batch_hist);
+        hist_merge(&total[1], &w->write_lat_hist);
+        hist_merge(&total[2], &w->transfer_hist);
+        hist_merge(&total[3], &w->fanout_hist);
+        hist_merge(&total[4], &w->sync_hist);
+        hist_merge(&total[5], &w->group_hist);
+    }
+    dprintf(out, "all workers: %lu connections, limit %u, rejected %lu\n", connections, max_conn, rejected);
+    if (total) {
+        print_histogram(out, "cqe batch", &total[0], 1);
+        print_histogram(out, "read to write done (us)", &total[1], 1e3);
+        print_histogram(out, "transfer (ms)", &total[2], 1e6);
+        print_histogram(out, "broadcast fan-out (us)", &total[3], 1e3);
+        print_histogram(out, "last write to synced (us)", &total[4], 1e3);
+        print_histogram(out, "files per group commit", &total[5], 1);
+        free(total);
+    }
+    if (backend == BACKEND_DEDUP)
+        dprintf(out, "dedup: %lu bytes chunked, %lu stored, ratio %.2f, %lu chunks indexed\n",
+                chunked, stored, stored ? (double)chunked / stored : chunked ? __builtin_inf() : 1,
+                chunk_index_count);
+    dprintf(out, "buffered bytes %lu, peak %lu", buffered_bytes, buffered_peak);
+    if (mem_budget) dprintf(out, ", budget %lu (%lu per worker)", mem_budget, worker_budget);
+    dprintf(out, "\n");
+}
+
 /*
  * This function is responsible for setting up the main listening socket used by the
  * web server.
@@ -93,6 +1223,12 @@ int setup_listening_socket(int port) {
                    &enable, sizeof(int)) < 0)
         fatal_error("setsockopt(SO_REUSEADDR)");
 
+    /* Every worker binds its own socket to the same port */
+    if (setsockopt(sock,
+                   SOL_SOCKET, SO_REUSEPORT,
+                   &enable, sizeof(int)) < 0)
+        fatal_error("setsockopt(SO_REUSEPORT)");
+
 
     memset(&srv_addr, 0, sizeof(srv_addr));
     srv_addr.sin_family = AF_INET;
@@ -107,105 +1243,2121 @@ int setup_listening_socket(int port) {
              sizeof(srv_addr)) < 0)
         fatal_error("bind()");
 
-    if (listen(sock, MAX_CONN) < 0)
+    if (listen(sock, max_conn) < 0)
         fatal_error("listen()");
 
     return (sock);
 }
 
-int add_accept_request(int server_socket, struct sockaddr_in *client_addr,
-                       socklen_t *client_addr_len) {
-    struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
-    io_uring_prep_accept(sqe, server_socket, (struct sockaddr *) client_addr,
-                         client_addr_len, 0);
-    struct request *req = malloc(sizeof(*req));
-    req->event_type = EVENT_TYPE_ACCEPT;
-    io_uring_sqe_set_data(sqe, req);
-    io_uring_submit(&ring);
+/*
+ * Submits the queued SQEs and waits for wait_nr completions. enter_calls
+ * counts the io_uring_enter() calls liburing makes for it: waiting always
+ * enters, a plain submit only with SQEs to hand over, or under SQPOLL only
+ * when the SQ thread went to sleep and needs a wakeup.
+ * */
 
-    return 0;
+int submit(worker *w, unsigned wait_nr)
+{
+    if (wait_nr)
+        ++w->enter_calls;
+    else if (sqpoll ? IO_URING_READ_ONCE(*w->ring.sq.kflags) & IORING_SQ_NEED_WAKEUP
+                    : io_uring_sq_ready(&w->ring) != 0)
+        ++w->enter_calls;
+    return wait_nr ? io_uring_submit_and_wait(&w->ring, wait_nr) : io_uring_submit(&w->ring);
 }
 
-int add_read_request(connection *client) {
-    struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
-    struct request *req = zh_malloc(sizeof(*req) + sizeof(struct iovec));
-    req->iov[0].iov_base = zh_malloc(READ_SZ);
-    req->iov[0].iov_len = READ_SZ;
-    req->event_type = EVENT_TYPE_READ;
-    req->client_socket = client->sockfd;
-    req->signature = client->signature;
-    memset(req->iov[0].iov_base, 0, READ_SZ);
-    /* Linux kernel 5.5 has support for readv, but not for recv() or read() */
-    io_uring_prep_readv(sqe, client->sockfd, &req->iov[0], 1, 0);
+/*
+ * SQEs are only queued here, server_loop submits everything queued during a
+ * batch at once. If the SQ ring fills up mid-batch, flush it and retry.
+ * */
+
+struct io_uring_sqe *get_sqe(worker *w)
+{
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&w->ring);
+    while (!sqe) {
+        ++w->sq_full_events;
+        int ret = submit(w, 0);
+        if (ret < 0 && ret != -EBUSY && ret != -EAGAIN && ret != -EINTR) {
+            errno = -ret;
+            fatal_error("io_uring_submit");
+        }
+        sqe = io_uring_get_sqe(&w->ring);
+    }
+    return sqe;
+}
+
+/*
+ * In multishot mode a single SQE keeps producing one CQE per accepted
+ * connection (flagged IORING_CQE_F_MORE) until the kernel terminates it, so
+ * it is only re-armed when a completion arrives without that flag. No peer
+ * address is captured here since several accepts can complete before the
+ * first is handled; handleNewConn() asks the socket itself instead.
+ * A direct descriptor cannot be asked, so with -f every accept is single
+ * shot and writes the peer address to accept_addrs[slot].
+ * */
+
+int add_accept_request(worker *w, int slot) {
+    struct io_uring_sqe *sqe = get_sqe(w);
+    if (fixed_files) {
+        w->accept_addr_lens[slot] = sizeof(w->accept_addrs[slot]);
+        io_uring_prep_accept_direct(sqe, w->server_socket,
+                                    (struct sockaddr *)&w->accept_addrs[slot],
+                                    &w->accept_addr_lens[slot], 0, IORING_FILE_INDEX_ALLOC);
+    } else if (accept_mode == ACCEPT_MULTISHOT)
+        io_uring_prep_multishot_accept(sqe, w->server_socket, NULL, NULL, 0);
+    else
+        io_uring_prep_accept(sqe, w->server_socket, NULL, NULL, 0);
+    struct request *req = alloc_request(w, 0);
+    req->event_type = EVENT_TYPE_ACCEPT;
+    req->buf_id = slot;
     io_uring_sqe_set_data(sqe, req);
-    io_uring_submit(&ring);
+
     return 0;
 }
 
-int add_write_request(struct request *req) {
-    struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
-    req->event_type = EVENT_TYPE_WRITE;
-    io_uring_prep_writev(sqe, req->client_socket, req->iov, req->iovec_count, 0);
+int add_control_request(worker *w) {
+    struct io_uring_sqe *sqe = get_sqe(w);
+    struct request *req = alloc_request(w, 0);
+    req->event_type = EVENT_TYPE_CONTROL;
+    io_uring_prep_read(sqe, w->event_fd, &w->event_val, sizeof(w->event_val), 0);
     io_uring_sqe_set_data(sqe, req);
-    io_uring_submit(&ring);
     return 0;
 }
 
-int get_line(const char *src, char *dest, int dest_sz) {
-    for (int i = 0; i < dest_sz; i++) {
-        dest[i] = src[i];
-        if (src[i] == '\r' && src[i+1] == '\n') {
-            dest[i] = '\0';
-            return 0;
-        }
+void setup_buffer_ring(worker *w)
+{
+    int ret;
+    if (posix_memalign((void **)&w->buf_pool, 4096, (size_t)buf_count * buf_size))
+        fatal_error("posix_memalign()");
+    w->buf_refs = zh_malloc(buf_count * sizeof(*w->buf_refs));
+    memset(w->buf_refs, 0, buf_count * sizeof(*w->buf_refs));
+    w->buf_ring = io_uring_setup_buf_ring(&w->ring, buf_count, BUF_GROUP_ID, 0, &ret);
+    if (!w->buf_ring) {
+        errno = -ret;
+        fatal_error("io_uring_setup_buf_ring()");
     }
-    return 1;
+    for (uint32_t bid = 0; bid < buf_count; ++bid)
+        io_uring_buf_ring_add(w->buf_ring, w->buf_pool + (size_t)bid * buf_size, buf_size, bid,
+                              io_uring_buf_ring_mask(buf_count), bid);
+    io_uring_buf_ring_advance(w->buf_ring, buf_count);
+    w->buf_available = buf_count;
 }
 
-uint32_t handleNewConn(uint32_t client_socket, struct sockaddr_in *client_addr)
-{
-    char fileName[1024];
-    memset(fileName, 0, sizeof(fileName));
-    uint64_t ip = client_addr->sin_addr.s_addr;
-    if (curr_connection >= MAX_CONN) return -1;
-    uint32_t empty_conn;
-    for (empty_conn = 0 ; conns_list[empty_conn] && empty_conn < MAX_CONN ; ++empty_conn);
-    if (empty_conn == MAX_CONN) return -1;
-    conns_list[empty_conn] = (connection *)zh_malloc(sizeof(connection));
-    conns_list[empty_conn]->sockfd = client_socket;
-    conns_list[empty_conn]->filefd = -1;
-    conns_list[empty_conn]->isFileTransferring = 0;
-    conns_list[empty_conn]->signature = (ip << 16) | client_addr->sin_port;
-    conns_list[empty_conn]->start = 0;
-    snprintf(conns_list[empty_conn]->containedFolder,
-                sizeof(conns_list[empty_conn]->containedFolder),
-                "davy_jones_locker/%u.%u.%u.%u",
-                (client_addr->sin_addr.s_addr >> 0) & 0xff,
-                (client_addr->sin_addr.s_addr >> 8) & 0xff,
-                (client_addr->sin_addr.s_addr >> 16) & 0xff,
-                (client_addr->sin_addr.s_addr >> 24) & 0xff);
-    mkdir(conns_list[empty_conn]->containedFolder, 0777);
-    /*
+int add_read_request(worker *w, connection *client) {
+    struct io_uring_sqe *sqe = get_sqe(w);
+    struct request *req = alloc_request(w, 1);
+    req->event_type = EVENT_TYPE_READ;
+    req->client_socket = client->sockfd;
+    req->conn = client;
+    client->read_armed = 1;
+    client->waiting_since = w->now;
+    /* The kernel picks the buffer from BUF_GROUP_ID when the data arrives */
+    io_uring_prep_recv(sqe, client->sockfd, NULL, buf_size, 0);
+    if (fixed_files) sqe->flags |= IOSQE_FIXED_FILE;
+    sqe->flags |= IOSQE_BUFFER_SELECT;
+    sqe->buf_group = BUF_GROUP_ID;
+    io_uring_sqe_set_data(sqe, req);
+    return 0;
+}
+
+void park_starved(worker *w, connection *client)
+{
+    client->next_starved = 0x0;
+    if (w->starved_tail) w->starved_tail->next_starved = client;
+    else w->starved_head = client;
+    w->starved_tail = client;
+}
+
+void recycle_buffer(worker *w, int bid)
+{
+    io_uring_buf_ring_add(w->buf_ring, w->buf_pool + (size_t)bid * buf_size, buf_size, bid,
+                          io_uring_buf_ring_mask(buf_count), 0);
+    io_uring_buf_ring_advance(w->buf_ring, 1);
+    ++w->buf_available;
+    /* One buffer came back, so one starved connection can read again */
+    if (w->starved_head) {
+        connection *client = w->starved_head;
+        w->starved_head = client->next_starved;
+        if (!w->starved_head) w->starved_tail = 0x0;
+        add_read_request(w, client);
+    }
+}
+
+void put_buffer(worker *w, int bid)
+{
+    if (!--w->buf_refs[bid])
+        recycle_buffer(w, bid);
+}
+
+/* Closes a registered file without blocking the worker, see EVENT_TYPE_CLOSE_SLOT */
+void release_fixed_file(worker *w, int index)
+{
+    struct io_uring_sqe *sqe = get_sqe(w);
+    struct request *req = alloc_request(w, 0);
+    req->event_type = EVENT_TYPE_CLOSE_SLOT;
+    req->buf_id = index;
+    io_uring_prep_close_direct(sqe, index);
+    io_uring_sqe_set_data(sqe, req);
+}
+
+/* A free staging chunk, from the arena while it lasts */
+uint8_t *get_stage(worker *w)
+{
+    uint8_t *chunk;
+    if (w->stage_free_top)
+        return w->arena + (size_t)w->stage_free[--w->stage_free_top] * DIRECT_CHUNK;
+    ++w->stage_misses;
+    if (posix_memalign((void **)&chunk, DIRECT_ALIGN, DIRECT_CHUNK))
+        fatal_error("posix_memalign()");
+    return chunk;
+}
+
+int in_arena(worker *w, const uint8_t *data)
+{
+    return data >= w->arena && data < w->arena + w->arena_len;
+}
+
+void put_stage(worker *w, uint8_t *chunk)
+{
+    if (in_arena(w, chunk))
+        w->stage_free[w->stage_free_top++] = (chunk - w->arena) / DIRECT_CHUNK;
+    else
+        free(chunk);
+}
+
+/*
+ * Writes the data of req at off, from the registered arena as a fixed
+ * buffer. What a short write left, past done, goes out again the same way.
+ * */
+
+void prep_file_write(worker *w, struct io_uring_sqe *sqe, upload_file *file, struct request *req, uint64_t off)
+{
+    char *data = (char *)req->iov[0].iov_base + req->done;
+    uint32_t len = req->iov[0].iov_len - req->done;
+    req->off = off;
+    if (w->arena_registered && in_arena(w, req->iov[0].iov_base)) {
+        io_uring_prep_write_fixed(sqe, file->fd, data, len, off + req->done, 0);
+        ++w->fixed_writes;
+    } else {
+        io_uring_prep_write(sqe, file->fd, data, len, off + req->done);
+    }
+    if (file->fixed) sqe->flags |= IOSQE_FIXED_FILE;
+    io_uring_sqe_set_data(sqe, req);
+}
+
+/* Receives the rest of a direct upload straight into its staging chunk */
+int add_stage_read(worker *w, connection *client) {
+    upload_file *file = client->file;
+    struct io_uring_sqe *sqe = get_sqe(w);
+    struct request *req = alloc_request(w, 0);
+    uint32_t len = DIRECT_CHUNK - file->stage_fill;
+    if (!file->stage) file->stage = get_stage(w);
+    if (len > client->splice_remaining) len = client->splice_remaining;
+    req->event_type = EVENT_TYPE_STAGE_IN;
+    req->client_socket = client->sockfd;
+    req->conn = client;
+    client->read_armed = 1;
+    client->waiting_since = w->now;
+    io_uring_prep_recv(sqe, client->sockfd, file->stage + file->stage_fill, len, 0);
+    if (fixed_files) sqe->flags |= IOSQE_FIXED_FILE;
+    io_uring_sqe_set_data(sqe, req);
+    return 0;
+}
+
+/* The next read of a connection, into a staging chunk or a pooled buffer */
+int arm_read(worker *w, connection *client)
+{
+    if (client->splice_remaining) return add_stage_read(w, client);
+    return add_read_request(w, client);
+}
+
+void close_socket(worker *w, int sockfd)
+{
+    if (fixed_files) release_fixed_file(w, sockfd);
+    else close(sockfd);
+}
+
+uint32_t dir_bucket(uint32_t addr)
+{
+    return (addr * 2654435761u) >> (32 - DIR_BUCKET_BITS);
+}
+
+void dir_idle_remove(worker *w, dir_entry *dir)
+{
+    if (dir->idle_prev) dir->idle_prev->idle_next = dir->idle_next;
+    else w->dir_idle_head = dir->idle_next;
+    if (dir->idle_next) dir->idle_next->idle_prev = dir->idle_prev;
+    else w->dir_idle_tail = dir->idle_prev;
+    --w->dirs_idle;
+}
+
+void dir_evict(worker *w, dir_entry *dir)
+{
+    dir_entry **link = &w->dir_buckets[dir_bucket(dir->addr)];
+    while (*link != dir) link = &(*link)->next;
+    *link = dir->next;
+    if (dir->fd >= 0) close(dir->fd);
+    free(dir);
+}
+
+/* Keeps an opened entry nobody uses for the next connection from its client */
+void dir_unused(worker *w, dir_entry *dir)
+{
+    if (dir->failed) {
+        /* The next connection tries again */
+        dir_evict(w, dir);
+        return;
+    }
+    dir->idle_next = 0x0;
+    dir->idle_prev = w->dir_idle_tail;
+    if (w->dir_idle_tail) w->dir_idle_tail->idle_next = dir;
+    else w->dir_idle_head = dir;
+    w->dir_idle_tail = dir;
+    if (++w->dirs_idle > DIR_CACHE_IDLE) {
+        dir_entry *oldest = w->dir_idle_head;
+        dir_idle_remove(w, oldest);
+        dir_evict(w, oldest);
+    }
+}
+
+/* An entry still opening is looked after by its open completion */
+void put_dir(worker *w, dir_entry *dir)
+{
+    if (!--dir->refs && (dir->fd >= 0 || dir->failed))
+        dir_unused(w, dir);
+}
+
+/* Frees a closed connection once nothing in flight points at it */
+void release_connection(connection *conn)
+{
+    if (conn->closed && !conn->writes_inflight && !conn->acks_pending) {
+        free(conn->cold);
+        free(conn);
+    }
+}
+
+void close_connection(worker *w, connection *conn);
+
+/* One ack less to wait for, a client that finished sending is closed after the last */
+void put_ack(worker *w, connection *conn)
+{
+    if (--conn->acks_pending) return;
+    if (conn->draining && !conn->closed) close_connection(w, conn);
+    else release_connection(conn);
+}
+
+/*
+ * Writes a header of type with name and no payload to conn. The caller
+ * counted it as a pending ack, which its completion drops, so a draining
+ * connection is not closed under it.
+ * */
+
+void send_frame(worker *w, connection *conn, uint8_t type, uint8_t flags, const char *name, uint64_t length)
+{
+    size_t name_len = strlen(name);
+    struct frame_header *hdr = zh_malloc(sizeof(*hdr) + name_len);
+    memcpy(hdr->magic, FRAME_MAGIC, FRAME_MAGIC_SZ);
+    hdr->type = type;
+    hdr->flags = flags;
+    hdr->name_len = htole16(name_len);
+    hdr->length = htole64(length);
+    memcpy(hdr + 1, name, name_len);
+    struct io_uring_sqe *sqe = get_sqe(w);
+    struct request *req = alloc_request(w, 1);
+    req->event_type = EVENT_TYPE_ACK;
+    req->conn = conn;
+    req->iov[0].iov_base = hdr;
+    req->iov[0].iov_len = sizeof(*hdr) + name_len;
+    io_uring_prep_write(sqe, conn->sockfd, hdr, req->iov[0].iov_len, 0);
+    if (fixed_files) sqe->flags |= IOSQE_FIXED_FILE;
+    io_uring_sqe_set_data(sqe, req);
+}
+
+/* Confirms a stored upload with its name and size, unless the client is gone already */
+void send_ack(worker *w, upload_file *file)
+{
+    connection *conn = file->ack_conn;
+    if (conn->closed) {
+        put_ack(w, conn);
+    } else {
+        send_frame(w, conn, FRAME_TYPE_ACK,
+                   (file->digest.type == DIGEST_CRC32C ? FRAME_FLAG_CRC32C : 0) |
+                   (file->digest.type == DIGEST_SHA256 ? FRAME_FLAG_SHA256 : 0) |
+                   (file->digest_bad ? FRAME_FLAG_BAD_DIGEST : 0) |
+                   (file->stripe ? FRAME_FLAG_STRIPE : 0),
+                   file->name, file->stripe ? file->stripe_landed : upload_bytes(file));
+        ++w->acks;
+    }
+}
+
+/* Tells a client resuming name to go on from off */
+void send_offset(worker *w, connection *conn, const char *name, uint64_t off)
+{
+    ++conn->acks_pending;
+    send_frame(w, conn, FRAME_TYPE_OFFSET, 0, name, off);
+}
+
+/*
+ * Stores the digest of an upload next to it, in the format of sha256sum.
+ * The open of <name>.<algorithm> holds the directory, its completion
+ * queues the write hard-linked to the close.
+ * */
+
+void write_sidecar(worker *w, upload_file *file)
+{
+    size_t name_len = strlen(file->name);
+    char *buf = zh_malloc(2 * name_len + 2 * DIGEST_MAX + 16);
+    int path_len = sprintf(buf, "%s.%s", file->name,
+                           file->digest.type == DIGEST_CRC32C ? "crc32c" : "sha256") + 1;
+    digest_hex(file->digest.type, file->sum, buf + path_len);
+    int len = path_len + strlen(buf + path_len);
+    len += sprintf(buf + len, "  %s\n", file->name);
+    struct io_uring_sqe *sqe = get_sqe(w);
+    struct request *req = alloc_request(w, 1);
+    req->event_type = EVENT_TYPE_SIDECAR_OPEN;
+    req->dir = file->dir;
+    ++file->dir->refs;
+    req->iov[0].iov_base = buf;
+    req->iov[0].iov_len = len;
+    io_uring_prep_openat(sqe, file->dir->fd, buf, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                         S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+    io_uring_sqe_set_data(sqe, req);
+}
+
+/* The sidecar is open, req moves on to its write */
+void sidecar_opened(worker *w, struct request *req, int res)
+{
+    char *buf = req->iov[0].iov_base;
+    int path_len = strlen(buf) + 1;
+    if (res < 0) {
+        log_record *rec = log_begin(w, LOG_ERROR);
+        if (rec) {
+            rec->addr = req->dir->addr;
+            rec->what = "cannot write digest";
+            rec->err = -res;
+            strncpy(rec->name, buf, LOG_NAME_SZ - 1);
+            log_commit(w);
+        }
+    }
+    put_dir(w, req->dir);
+    if (res < 0) {
+        free(buf);
+        free_request(w, req);
+        return;
+    }
+    struct io_uring_sqe *sqe = get_sqe(w);
+    req->event_type = EVENT_TYPE_SIDECAR_WRITE;
+    io_uring_prep_write(sqe, res, buf + path_len, req->iov[0].iov_len - path_len, 0);
+    /* The close runs even if the write fails */
+    sqe->flags |= IOSQE_IO_HARDLINK;
+    io_uring_sqe_set_data(sqe, req);
+    sqe = get_sqe(w);
+    struct request *close_req = alloc_request(w, 0);
+    close_req->event_type = EVENT_TYPE_SIDECAR_CLOSE;
+    io_uring_prep_close(sqe, res);
+    io_uring_sqe_set_data(sqe, close_req);
+    ++w->sidecars;
+}
+
+/* A stored resumable or striped upload takes its name, the rename's completion releases it */
+void rename_part(worker *w, upload_file *file)
+{
+    struct io_uring_sqe *sqe = get_sqe(w);
+    struct request *req = alloc_request(w, 0);
+    req->event_type = EVENT_TYPE_PART_RENAME;
+    req->file = file;
+    io_uring_prep_renameat(sqe, file->dir->fd, file->path, file->dir->fd, file->name, 0);
+    io_uring_sqe_set_data(sqe, req);
+}
+
+/*
+ * Cuts a completed striped file to its size: a file left by an earlier
+ * transfer with the same ID, before a restart or once forgotten, may be
+ * longer. IORING_OP_FTRUNCATE is too recent to rely on, and this happens
+ * once per file, so it is a plain truncate() on its path.
+ * */
+
+int truncate_stripe(worker *w, upload_file *file)
+{
+    char path[CONN_FOLDER_SZ + sizeof(file->stripe->path)];
+    snprintf(path, sizeof(path), "%s/%s", file->dir->path, file->path);
+    if (truncate(path, file->stripe->size) < 0) {
+        log_file(w, LOG_ERROR, file, "cannot truncate", errno);
+        return 0;
+    }
+    return 1;
+}
+
+/* Drops the oldest unfinished file nobody uploads to, under stripe_lock */
+void forget_stripe()
+{
+    stripe **p = &stripes, **oldest = 0x0;
+    for (; *p; p = &(*p)->next)
+        if (!(*p)->refs) oldest = p;
+    if (!oldest) return;
+    stripe *s = *oldest;
+    *oldest = s->next;
+    --stripe_count;
+    free(s->ranges);
+    free(s);
+}
+
+/*
+ * The striped upload of name from the client at addr with ext's transfer
+ * ID, found or started, with a reference for a range of it. NULL if the
+ * transfer is already under way with another name or size.
+ * */
+
+stripe *get_stripe(uint32_t addr, const struct frame_stripe *ext, const char *name, int name_len)
+{
+    pthread_mutex_lock(&stripe_lock);
+    stripe *s = stripes;
+    while (s && (s->addr != addr || memcmp(s->id, ext->id, sizeof(s->id))))
+        s = s->next;
+    if (s && (s->size != le64toh(ext->size) || strncmp(s->name, name, name_len) || s->name[name_len])) {
+        s = 0x0;
+    } else if (s) {
+        ++s->refs;
+    } else {
+        s = zh_malloc(sizeof(*s));
+        s->addr = addr;
+        memcpy(s->id, ext->id, sizeof(s->id));
+        s->size = le64toh(ext->size);
+        s->refs = 1;
+        s->done = 0;
+        s->ranges_len = 0;
+        s->ranges_cap = 8;
+        s->ranges = zh_malloc(s->ranges_cap * sizeof(*s->ranges));
+        s->landed = 0;
+        memcpy(s->name, name, name_len);
+        s->name[name_len] = '\0';
+        memcpy(s->path, STRIPE_PREFIX, sizeof(STRIPE_PREFIX) - 1);
+        for (int i = 0; i < FRAME_RESUME_ID_SZ; ++i)
+            sprintf(s->path + sizeof(STRIPE_PREFIX) - 1 + 2 * i, "%02x", s->id[i]);
+        s->next = stripes;
+        stripes = s;
+        if (++stripe_count > STRIPE_KEEP) forget_stripe();
+    }
+    pthread_mutex_unlock(&stripe_lock);
+    return s;
+}
+
+/*
+ * [start, end) of s is stored. Merges it with the landed ranges it touches
+ * and returns 1 if that completes the file, which then leaves the list so
+ * the transfer ID can start over. *landed gets the bytes landed.
+ * */
+
+int land_range(stripe *s, uint64_t start, uint64_t end, uint64_t *landed)
+{
+    uint32_t i = 0, j;
+    int done = 0;
+    pthread_mutex_lock(&stripe_lock);
+    if (start == end) goto check;
+    while (i < s->ranges_len && s->ranges[i][1] < start) ++i;
+    for (j = i; j < s->ranges_len && s->ranges[j][0] <= end; ++j) {
+        s->landed -= s->ranges[j][1] - s->ranges[j][0];
+        if (s->ranges[j][0] < start) start = s->ranges[j][0];
+        if (s->ranges[j][1] > end) end = s->ranges[j][1];
+    }
+    if (i == j && s->ranges_len == s->ranges_cap) {
+        s->ranges_cap *= 2;
+        s->ranges = zh_realloc(s->ranges, s->ranges_cap * sizeof(*s->ranges));
+    }
+    /* [i, j) collapse into one, or one is inserted at i */
+    memmove(s->ranges + i + 1, s->ranges + j, (s->ranges_len - j) * sizeof(*s->ranges));
+    s->ranges_len = s->ranges_len - (j - i) + 1;
+    s->ranges[i][0] = start;
+    s->ranges[i][1] = end;
+    s->landed += end - start;
+check:
+    *landed = s->landed;
+    if (s->landed == s->size && !s->done) {
+        stripe **p = &stripes;
+        while (*p != s) p = &(*p)->next;
+        *p = s->next;
+        --stripe_count;
+        s->done = done = 1;
+    }
+    pthread_mutex_unlock(&stripe_lock);
+    return done;
+}
+
+/* A range upload of s is released, the last one frees a completed file */
+void put_stripe(stripe *s)
+{
+    pthread_mutex_lock(&stripe_lock);
+    int last = !--s->refs && s->done;
+    pthread_mutex_unlock(&stripe_lock);
+    if (last) {
+        free(s->ranges);
+        free(s);
+    }
+}
+
+/* Closes a file for good, confirming it if it was stored */
+void release_file(worker *w, upload_file *file, int stored)
+{
+    if (stored && file->resume) {
+        rename_part(w, file);
+        return;
+    }
+    if (stored && file->stripe && !file->landed) {
+        file->landed = 1;
+        if (land_range(file->stripe, file->base, file->off, &file->stripe_landed)) {
+            ++w->stripe_files;
+            stored = truncate_stripe(w, file);
+            if (stored) {
+                rename_part(w, file);
+                return;
+            }
+        }
+    }
+    if (!file->failed) log_file(w, LOG_TRANSFER, file, stored ? 0x0 : "incomplete", 0);
+    if (stored && file->digest.type) write_sidecar(w, file);
+    if (!file->failed) {
+        if (file->fixed) release_fixed_file(w, file->fd);
+        else close(file->fd);
+    } else if (file->fixed) {
+        /* The open failed, nothing was installed in the slot */
+        w->file_slots[w->file_slots_top++] = file->fd;
+    }
+    /* An upload cut short still holds its last chunk */
+    if (file->stage) put_stage(w, file->stage);
+    free(file->tail);
+    if (file->cdc) {
+        put_stage(w, file->cdc->buf);
+        free(file->cdc->lines);
+        free(file->cdc);
+    }
+    if (file->ack_conn) {
+        if (stored) send_ack(w, file);
+        else put_ack(w, file->ack_conn);
+    }
+    if (file->stripe) put_stripe(file->stripe);
+    put_dir(w, file->dir);
+    free(file);
+}
+
+/* Syncs the file's data and size, the fsync completion releases it */
+void add_fsync_request(worker *w, upload_file *file)
+{
+    struct io_uring_sqe *sqe = get_sqe(w);
+    struct request *req = alloc_request(w, 0);
+    req->event_type = EVENT_TYPE_FSYNC;
+    req->file = file;
+    io_uring_prep_fsync(sqe, file->fd, IORING_FSYNC_DATASYNC);
+    if (file->fixed) sqe->flags |= IOSQE_FIXED_FILE;
+    io_uring_sqe_set_data(sqe, req);
+    ++w->syncs;
+}
+
+/* The group commit window closed, every file queued during it is synced in one batch */
+void group_commit(worker *w)
+{
+    hist_record(&w->group_hist, w->sync_queued);
+    while (w->sync_head) {
+        upload_file *file = w->sync_head;
+        w->sync_head = file->next_sync;
+        add_fsync_request(w, file);
+    }
+    w->sync_queued = 0;
+    w->group_armed = 0;
+}
+
+void fail_file_write(worker *w, upload_file *file, int err);
+
+/*
+ * Writes the tail of a complete direct upload once its chunk writes are
+ * done, through the page cache since it is not a multiple of DIRECT_ALIGN.
+ * The fd is a plain one for that reason. The write holds the last
+ * reference, so the file is written again when it completes. Returns 0 if
+ * O_DIRECT cannot be cleared, the upload then failed.
+ * */
+
+int write_tail(worker *w, upload_file *file)
+{
+    if (file->odirect) {
+        int flags = fcntl(file->fd, F_GETFL);
+        if (flags < 0 || fcntl(file->fd, F_SETFL, flags & ~O_DIRECT) < 0) {
+            fail_file_write(w, file, errno);
+            return 0;
+        }
+        file->odirect = 0;
+    }
+    struct io_uring_sqe *sqe = get_sqe(w);
+    struct request *req = alloc_request(w, 1);
+    req->event_type = EVENT_TYPE_STAGE_OUT;
+    req->file = file;
+    req->iov[0].iov_base = file->tail;
+    req->iov[0].iov_len = file->tail_len;
+    req->done = 0;
+    file->tail = 0x0;
+    ++file->refs;
+    prep_file_write(w, sqe, file, req, file->off - file->tail_len);
+    ++w->tail_writes;
+    return 1;
+}
+
+/*
+ * Records how far a resumable upload got once nothing of it is in flight,
+ * so all of [0, off) is written: an fdatasync, and the record linked behind
+ * it, which holds a reference. Periodic ones wait for RESUME_CHECKPOINT new
+ * bytes, one for an upload cut short does not. Returns 1 if one was queued.
+ * */
+
+int checkpoint_file(worker *w, upload_file *file, int cut)
+{
+    if (file->resume != RESUME_KNOWN || file->failed || file->write_failed || file->complete || file->inflight ||
+        file->checkpointing || file->checkpoint_failed ||
+        file->off - file->checkpointed < (cut ? 1 : RESUME_CHECKPOINT))
+        return 0;
+    struct resume_record *rec = zh_malloc(sizeof(*rec));
+    memcpy(rec->id, file->resume_id, sizeof(rec->id));
+    rec->size = htole64(file->size);
+    rec->durable = htole64(file->off);
+    struct io_uring_sqe *sqe = get_sqe(w);
+    struct request *req = alloc_request(w, 0);
+    req->event_type = EVENT_TYPE_CHECKPOINT_SYNC;
+    req->file = file;
+    io_uring_prep_fsync(sqe, file->fd, IORING_FSYNC_DATASYNC);
+    sqe->flags |= IOSQE_IO_LINK | (file->fixed ? IOSQE_FIXED_FILE : 0);
+    io_uring_sqe_set_data(sqe, req);
+    sqe = get_sqe(w);
+    req = alloc_request(w, 1);
+    req->event_type = EVENT_TYPE_CHECKPOINT;
+    req->file = file;
+    req->iov[0].iov_base = rec;
+    req->iov[0].iov_len = sizeof(*rec);
+    ++file->refs;
+    io_uring_prep_fsetxattr(sqe, file->fd, RESUME_XATTR, (const char *)rec, 0, sizeof(*rec));
+    if (file->fixed) sqe->flags |= IOSQE_FIXED_FILE;
+    io_uring_sqe_set_data(sqe, req);
+    file->checkpointing = 1;
+    ++w->checkpoints;
+    return 1;
+}
+
+/*
+ * The last reference to a file is gone, so every write to it completed. A
+ * complete upload is synced first if the policy says so, a resumable one
+ * cut short is checkpointed, anything else is released right away.
+ * */
+
+void file_written(worker *w, upload_file *file)
+{
+    if (file->tail && file->complete && !file->failed && !file->write_failed &&
+        write_tail(w, file))
+        return;
+    if (checkpoint_file(w, file, 1))
+        return;
+    int lost = file->write_failed || (file->cdc && file->cdc->lost);
+    if (!file->failed) hist_record(&w->transfer_hist, w->now - file->opened);
+    if (!file->complete || file->failed || lost || durability == DURABILITY_NONE) {
+        release_file(w, file, file->complete && !file->failed && !lost);
+        return;
+    }
+    file->done_at = w->now;
+    if (durability == DURABILITY_EOF) {
+        add_fsync_request(w, file);
+        return;
+    }
+    file->next_sync = w->sync_head;
+    w->sync_head = file;
+    ++w->sync_queued;
+    if (!w->group_armed) {
+        struct io_uring_sqe *sqe = get_sqe(w);
+        struct request *req = alloc_request(w, 0);
+        req->event_type = EVENT_TYPE_GROUP_COMMIT;
+        io_uring_prep_timeout(sqe, &w->group_ts, 0, 0);
+        io_uring_sqe_set_data(sqe, req);
+        w->group_armed = 1;
+    }
+}
+
+void put_file(worker *w, upload_file *file)
+{
+    if (!--file->refs) file_written(w, file);
+}
+
+/* A checkpoint's record is written, or its sync or the record failed */
+void checkpoint_done(worker *w, struct request *req, int res)
+{
+    upload_file *file = req->file;
+    struct resume_record *rec = req->iov[0].iov_base;
+    file->checkpointing = 0;
+    if (res < 0) {
+        /* Canceled if the sync failed, which logged already */
+        if (res != -ECANCELED) log_file(w, LOG_ERROR, file, "cannot write resume record", -res);
+        file->checkpoint_failed = 1;
+        ++w->checkpoint_errors;
+    } else {
+        file->checkpointed = le64toh(rec->durable);
+    }
+    free(rec);
+    free_request(w, req);
+    put_file(w, file);
+}
+
+/*
+ * Counts len more bytes of file as written. Under a sync policy, every
+ * SYNC_CHUNK of them starts writeback of [kicked, written), the file range
+ * written since the last time, holding a reference until it is queued to
+ * the device.
+ * */
+
+void file_progress(worker *w, upload_file *file, uint64_t len)
+{
+    file->written += len;
+    if (durability == DURABILITY_NONE || file->written - file->kicked < SYNC_CHUNK)
+        return;
+    struct io_uring_sqe *sqe = get_sqe(w);
+    struct request *req = alloc_request(w, 0);
+    req->event_type = EVENT_TYPE_SYNC_RANGE;
+    req->file = file;
+    ++file->refs;
+    io_uring_prep_sync_file_range(sqe, file->fd, file->written - file->kicked, file->kicked,
+                                  SYNC_FILE_RANGE_WRITE);
+    if (file->fixed) sqe->flags |= IOSQE_FIXED_FILE;
+    io_uring_sqe_set_data(sqe, req);
+    file->kicked = file->written;
+}
+
+void put_broadcast(worker *w, broadcast *payload)
+{
+    if (!__atomic_sub_fetch(&payload->refs, 1, __ATOMIC_ACQ_REL)) {
+        hist_record(&w->fanout_hist, now_ns() - payload->queued);
+        free(payload);
+    }
+}
+
+/* Pushes cmd on w's mailbox, from any thread */
+void post_command(worker *w, command *cmd)
+{
+    cmd->next = __atomic_load_n(&w->mailbox, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&w->mailbox, &cmd->next, cmd, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+    /* Otherwise a wake-up is already pending and the worker takes this with the rest */
+    if (!cmd->next && eventfd_write(w->event_fd, 1) < 0)
+        fatal_error("eventfd_write()");
+}
+
+int add_write_request(worker *w, struct request *req) {
+    struct io_uring_sqe *sqe = get_sqe(w);
+    req->event_type = EVENT_TYPE_WRITE;
+    io_uring_prep_writev(sqe, req->client_socket, req->iov, req->iovec_count, 0);
+    if (fixed_files) sqe->flags |= IOSQE_FIXED_FILE;
+    io_uring_sqe_set_data(sqe, req);
+    return 0;
+}
+
+/*
+ * EVENT_TYPE_SPLICE_IN fills the connection's pipe from its socket, at most
+ * SPLICE_SZ bytes and never past the announced payload. EVENT_TYPE_SPLICE_OUT
+ * drains whatever the last one put in the pipe into the file. The two
+ * alternate, so at most one splice per connection is in flight.
+ * */
+
+int add_splice_request(worker *w, connection *client, int event_type) {
+    struct io_uring_sqe *sqe = get_sqe(w);
+    struct request *req = alloc_request(w, 0);
+    req->event_type = event_type;
+    req->client_socket = client->sockfd;
+    req->conn = client;
+    /* The pipe is a plain fd, SPLICE_F_FD_IN_FIXED marks a registered input */
+    if (event_type == EVENT_TYPE_SPLICE_IN) {
+        client->read_armed = 1;
+        client->waiting_since = w->now;
+        io_uring_prep_splice(sqe, client->sockfd, -1, client->pipefd[1], -1,
+                             client->splice_remaining < SPLICE_SZ ? client->splice_remaining : SPLICE_SZ,
+                             SPLICE_F_MOVE | (fixed_files ? SPLICE_F_FD_IN_FIXED : 0));
+    } else {
+        io_uring_prep_splice(sqe, client->pipefd[0], -1, client->file->fd, client->file->off,
+                             client->pipe_pending, SPLICE_F_MOVE);
+        if (client->file->fixed) sqe->flags |= IOSQE_FIXED_FILE;
+    }
+    io_uring_sqe_set_data(sqe, req);
+    return 0;
+}
+
+int add_tick_request(worker *w) {
+    struct io_uring_sqe *sqe = get_sqe(w);
+    struct request *req = alloc_request(w, 0);
+    req->event_type = EVENT_TYPE_TICK;
+    io_uring_prep_timeout(sqe, &w->tick_ts, 0, 0);
+    io_uring_sqe_set_data(sqe, req);
+    return 0;
+}
+
+/* Files conn under the tick deadline falls in, at most one turn of the wheel ahead */
+void wheel_insert(worker *w, connection *conn, uint64_t deadline)
+{
+    uint64_t tick = (deadline + WHEEL_TICK_NS - 1) / WHEEL_TICK_NS;
+    if (tick < w->wheel_tick) tick = w->wheel_tick;
+    if (tick > w->wheel_tick + WHEEL_SLOTS - 1) tick = w->wheel_tick + WHEEL_SLOTS - 1;
+    connection **head = &w->wheel[tick & (WHEEL_SLOTS - 1)];
+    conn->wheel_next = *head;
+    if (*head) (*head)->wheel_prev = &conn->wheel_next;
+    conn->wheel_prev = head;
+    *head = conn;
+}
+
+void wheel_remove(connection *conn)
+{
+    if (!conn->wheel_prev) return;
+    *conn->wheel_prev = conn->wheel_next;
+    if (conn->wheel_next) conn->wheel_next->wheel_prev = conn->wheel_prev;
+    conn->wheel_prev = 0x0;
+}
+
+/* An upload is in progress from its first header byte on */
+int conn_uploading(connection *conn)
+{
+    return conn->file || conn->frame_have || conn->isFileTransferring;
+}
+
+/*
+ * Shuts the socket down, which completes the armed read or splice with 0 so
+ * the usual path closes the connection, and removes a partial upload that
+ * cannot be resumed and is not part of a striped one. Both
+ * go out with the rest of the tick's batch. The unlink holds a file
+ * reference for the name and its directory.
+ * */
+
+void expire_connection(worker *w, connection *conn, int stalled)
+{
+    struct io_uring_sqe *sqe;
+    struct request *req;
+    log_conn(w, LOG_TIMEOUT, conn, stalled ? "stalled" : "idle", 0);
+    if (stalled) ++w->stall_expired;
+    else ++w->idle_expired;
+    if (conn->file && !conn->file->failed && !conn->file->resume && !conn->file->stripe) {
+        sqe = get_sqe(w);
+        req = alloc_request(w, 0);
+        req->event_type = EVENT_TYPE_UNLINK;
+        req->file = conn->file;
+        ++conn->file->refs;
+        io_uring_prep_unlinkat(sqe, conn->file->dir->fd, conn->file->name, 0);
+        io_uring_sqe_set_data(sqe, req);
+    }
+    sqe = get_sqe(w);
+    req = alloc_request(w, 0);
+    req->event_type = EVENT_TYPE_SHUTDOWN;
+    io_uring_prep_shutdown(sqe, conn->sockfd, SHUT_RDWR);
+    if (fixed_files) sqe->flags |= IOSQE_FIXED_FILE;
+    io_uring_sqe_set_data(sqe, req);
+}
+
+/* Runs every tick up to now, each only over the connections filed under it */
+void wheel_advance(worker *w)
+{
+    uint64_t now_tick = w->now / WHEEL_TICK_NS;
+    while (w->wheel_tick <= now_tick) {
+        connection *conn = w->wheel[w->wheel_tick & (WHEEL_SLOTS - 1)];
+        w->wheel[w->wheel_tick & (WHEEL_SLOTS - 1)] = 0x0;
+        ++w->wheel_tick;
+        while (conn) {
+            connection *next = conn->wheel_next;
+            int uploading = conn_uploading(conn);
+            uint64_t timeout = uploading ? stall_timeout : idle_timeout;
+            conn->wheel_prev = 0x0;
+            if (!conn->read_armed || !timeout)
+                /* Check again once it could have expired */
+                wheel_insert(w, conn, w->now + (timeout ? timeout : WHEEL_SLOTS * WHEEL_TICK_NS));
+            else if (w->now - conn->waiting_since >= timeout)
+                expire_connection(w, conn, uploading);
+            else
+                wheel_insert(w, conn, conn->waiting_since + timeout);
+            conn = next;
+        }
+    }
+}
+
+int get_line(const char *src, char *dest, int dest_sz) {
+    for (int i = 0; i < dest_sz; i++) {
+        dest[i] = src[i];
+        if (src[i] == '\r' && src[i+1] == '\n') {
+            dest[i] = '\0';
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Doubles the connection table, the new slots go on the free stack low first */
+void grow_conn_table(worker *w)
+{
+    uint32_t cap = w->conns_cap ? w->conns_cap * 2 : CONN_TABLE_MIN;
+    w->conns_list = zh_realloc(w->conns_list, cap * sizeof(*w->conns_list));
+    memset(w->conns_list + w->conns_cap, 0, (cap - w->conns_cap) * sizeof(*w->conns_list));
+    w->free_slots = zh_realloc(w->free_slots, cap * sizeof(*w->free_slots));
+    for (uint32_t slot = cap; slot-- > w->conns_cap;)
+        w->free_slots[w->free_slots_top++] = slot;
+    w->conns_cap = cap;
+}
+
+/*
+ * Admits a client while fewer than max_conn are connected to the whole
+ * server, otherwise closes it and counts it as rejected.
+ * */
+
+int admit_connection(worker *w)
+{
+    if (__atomic_add_fetch(&total_connections, 1, __ATOMIC_RELAXED) <= max_conn)
+        return 1;
+    __atomic_sub_fetch(&total_connections, 1, __ATOMIC_RELAXED);
+    ++w->conns_rejected;
+    return 0;
+}
+
+/*
+ * Returns a reference to the directory of the client at addr. A new entry
+ * queues IORING_OP_MKDIRAT, hard-linked to the IORING_OP_OPENAT of the
+ * directory so it runs whether or not the directory already existed.
+ * */
+
+dir_entry *get_dir(worker *w, uint32_t addr)
+{
+    struct io_uring_sqe *sqe;
+    struct request *req;
+    dir_entry **head = &w->dir_buckets[dir_bucket(addr)];
+    for (dir_entry *dir = *head; dir; dir = dir->next) {
+        if (dir->addr != addr) continue;
+        if (!dir->refs && dir->fd >= 0) dir_idle_remove(w, dir);
+        ++dir->refs;
+        ++w->dir_hits;
+        return dir;
+    }
+    ++w->dir_misses;
+    dir_entry *dir = zh_malloc(sizeof(*dir));
+    dir->addr = addr;
+    dir->fd = -1;
+    dir->failed = 0;
+    dir->refs = 1;
+    dir->waiting = 0x0;
+    snprintf(dir->path, sizeof(dir->path), "davy_jones_locker/%u.%u.%u.%u",
+             (addr >> 0) & 0xff, (addr >> 8) & 0xff, (addr >> 16) & 0xff, (addr >> 24) & 0xff);
+    dir->next = *head;
+    *head = dir;
+
+    sqe = get_sqe(w);
+    req = alloc_request(w, 0);
+    req->event_type = EVENT_TYPE_MKDIR;
+    io_uring_prep_mkdirat(sqe, AT_FDCWD, dir->path, 0777);
+    sqe->flags |= IOSQE_IO_HARDLINK;
+    io_uring_sqe_set_data(sqe, req);
+    sqe = get_sqe(w);
+    req = alloc_request(w, 0);
+    req->event_type = EVENT_TYPE_OPEN_DIR;
+    req->dir = dir;
+    io_uring_prep_openat(sqe, AT_FDCWD, dir->path, O_PATH | O_DIRECTORY | O_CLOEXEC, 0);
+    io_uring_sqe_set_data(sqe, req);
+    return dir;
+}
+
+/* client_addr is the peer address captured by a direct accept, or NULL */
+
+uint32_t handleNewConn(worker *w, uint32_t client_socket, struct sockaddr_in *client_addr)
+{
+    struct sockaddr_in peer_addr;
+    socklen_t peer_addr_len = sizeof(peer_addr);
+    if (!admit_connection(w)) {
+        close_socket(w, client_socket);
+        return -1;
+    }
+    if (!client_addr) {
+        if (getpeername(client_socket, (struct sockaddr *)&peer_addr, &peer_addr_len) < 0) {
+            __atomic_sub_fetch(&total_connections, 1, __ATOMIC_RELAXED);
+            close_socket(w, client_socket);
+            return -1;
+        }
+        client_addr = &peer_addr;
+    }
+    if (!w->free_slots_top) grow_conn_table(w);
+    uint32_t empty_conn = w->free_slots[--w->free_slots_top];
+    connection *conn = zh_malloc(sizeof(*conn));
+    w->conns_list[empty_conn] = conn;
+    conn->cold = zh_malloc(sizeof(*conn->cold));
+    conn->sockfd = client_socket;
+    conn->slot = empty_conn;
+    conn->file = 0x0;
+    conn->isFileTransferring = 0;
+    conn->writes_inflight = 0;
+    conn->acks_pending = 0;
+    conn->buffered = 0;
+    conn->closed = 0;
+    conn->draining = 0;
+    conn->read_deferred = DEFER_NONE;
+    conn->pipefd[0] = -1;
+    conn->pipefd[1] = -1;
+    conn->splice_remaining = 0;
+    conn->pipe_pending = 0;
+    conn->proto = PROTO_UNKNOWN;
+    conn->frame_state = FRAME_STATE_HEADER;
+    conn->frame_have = 0;
+    conn->frame_remaining = 0;
+    conn->wheel_prev = 0x0;
+    conn->cold->signature = __atomic_add_fetch(&next_signature, 1, __ATOMIC_RELAXED);
+    conn->cold->dir = get_dir(w, client_addr->sin_addr.s_addr);
+    /*
     printf("New connection from %u.%u.%u.%u:%u - Signature: %lx\n", (client_addr->sin_addr.s_addr >> 0) & 0xff,
                                                                     (client_addr->sin_addr.s_addr >> 8) & 0xff,
                                                                     (client_addr->sin_addr.s_addr >> 16) & 0xff,
                                                                     (client_addr->sin_addr.s_addr >> 24) & 0xff,
                                                                     client_addr->sin_port,
-                                                                    conns_list[empty_conn]->signature);
+                                                                    conn->cold->signature);
     */                                                        
-    add_read_request(conns_list[empty_conn]);
-    ++curr_connection;
+    add_read_request(w, conn);
+    if (idle_timeout || stall_timeout)
+        wheel_insert(w, conn, w->now + (idle_timeout ? idle_timeout : stall_timeout));
+    if (++w->curr_connection > w->conns_peak)
+        w->conns_peak = w->curr_connection;
+    return 0;
+}
+
+void close_connection(worker *w, connection *conn)
+{
+    log_conn(w, LOG_CLOSE, conn, 0x0, 0);
+    w->conns_list[conn->slot] = 0x0;
+    w->free_slots[w->free_slots_top++] = conn->slot;
+    wheel_remove(conn);
+    put_dir(w, conn->cold->dir);
+    close_socket(w, conn->sockfd);
+    if (conn->file) {
+        /* An open or resume lookup still in flight must not go on with it */
+        if (conn->file->waiter == conn) conn->file->waiter = 0x0;
+        put_file(w, conn->file);
+    }
+    if (conn->pipefd[0] != -1) {
+        close(conn->pipefd[0]);
+        close(conn->pipefd[1]);
+    }
+    /* Writes still in flight point at it, the last one frees it */
+    conn->closed = 1;
+    release_connection(conn);
+    --w->curr_connection;
+    __atomic_sub_fetch(&total_connections, 1, __ATOMIC_RELAXED);
+}
+
+/* The client finished sending, it is closed once every upload it completed is acked */
+void peer_finished(worker *w, connection *conn)
+{
+    if (conn->acks_pending) conn->draining = 1;
+    else close_connection(w, conn);
+}
+
+/* Only the connection's own writes completing can lift these */
+int own_limits_hit(connection *conn)
+{
+    if (conn->file && conn->file->inflight >= write_depth) return 1;
+    return conn_budget && conn->buffered >= conn_budget;
+}
+
+int budget_hit(worker *w)
+{
+    /* Never hold back a worker with nothing in flight, nothing would wake it */
+    return w->buffered && w->buffered >= worker_budget;
+}
+
+int read_blocked(worker *w, connection *conn)
+{
+    return own_limits_hit(conn) || budget_hit(w);
+}
+
+/*
+ * Holds back the next read of conn, or lets it go if nothing holds it back
+ * any more. Past its own limits it waits for its own writes, otherwise it
+ * queues for the worker's budget.
+ * */
+
+void settle_deferred(worker *w, connection *conn)
+{
+    if (own_limits_hit(conn)) {
+        conn->read_deferred = DEFER_OWN;
+    } else if (budget_hit(w) || w->deferred_head) {
+        conn->read_deferred = DEFER_BUDGET;
+        conn->next_deferred = 0x0;
+        if (w->deferred_tail) w->deferred_tail->next_deferred = conn;
+        else w->deferred_head = conn;
+        w->deferred_tail = conn;
+    } else {
+        conn->read_deferred = DEFER_NONE;
+        arm_read(w, conn);
+    }
+}
+
+void defer_read(worker *w, connection *conn)
+{
+    settle_deferred(w, conn);
+    ++w->reads_deferred;
+}
+
+/* Called whenever a write completes, lets the line through while the budget allows */
+void resume_deferred(worker *w)
+{
+    while (w->deferred_head && !budget_hit(w)) {
+        connection *conn = w->deferred_head;
+        w->deferred_head = conn->next_deferred;
+        if (!w->deferred_head) w->deferred_tail = 0x0;
+        conn->read_deferred = DEFER_NONE;
+        arm_read(w, conn);
+    }
+}
+
+/*
+ * Queues the IORING_OP_OPENAT of file relative to its client's directory.
+ * With -f it opens straight into a free registered slot, otherwise it is
+ * used as a plain fd.
+ * */
+
+void submit_file_open(worker *w, upload_file *file)
+{
+    struct io_uring_sqe *sqe = get_sqe(w);
+    struct request *req = alloc_request(w, 0);
+    req->event_type = EVENT_TYPE_OPEN_FILE;
+    req->file = file;
+    /* A .part is only started over once its record says so, ranges share their file */
+    int trunc = file->resume == RESUME_LOOKUP || file->stripe ? 0 : O_TRUNC;
+    if (file->odirect) {
+        /* Its tail is written after clearing O_DIRECT, which needs a plain fd */
+        io_uring_prep_openat(sqe, file->dir->fd, file->name,
+                             O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | O_DIRECT,
+                             S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+    } else if (fixed_files && w->file_slots_top) {
+        file->fd = w->file_slots[--w->file_slots_top];
+        file->fixed = 1;
+        /* A registered file has no fd to inherit, O_CLOEXEC is refused */
+        io_uring_prep_openat_direct(sqe, file->dir->fd, file->path,
+                                    O_WRONLY | O_CREAT | trunc,
+                                    S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP, file->fd);
+    } else {
+        io_uring_prep_openat(sqe, file->dir->fd, file->path,
+                             O_WRONLY | O_CREAT | trunc | O_CLOEXEC,
+                             S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+    }
+    io_uring_sqe_set_data(sqe, req);
+}
+
+/*
+ * Starts opening <client dir>/<name> for an upload and returns it right
+ * away, writes queue up until the open completes. The connection holds the
+ * returned reference until the upload ends. size is the announced payload
+ * size, or 0, and digest the algorithm to digest it with. An upload with a
+ * resume_id goes to <name>.part, its offset is settled before any write.
+ * A range of a striped upload takes over the reference to its stripe and
+ * goes to the stripe's file at base.
+ * */
+
+upload_file *open_upload(worker *w, connection *conn, const char *name, int name_len, uint64_t size,
+                         uint8_t digest, const uint8_t *resume_id, stripe *stripe, uint64_t base)
+{
+    dir_entry *dir = conn->cold->dir;
+    uint8_t resume = resume_id && backend == BACKEND_PLAIN ? RESUME_LOOKUP : RESUME_NONE;
+    upload_file *file = zh_malloc(sizeof(*file) + name_len + 1 +
+                                  (resume ? name_len + sizeof(RESUME_SUFFIX) : 0));
+    memcpy(file->name, name, name_len);
+    file->name[name_len] = '\0';
+    file->path = file->name;
+    file->resume = resume;
+    file->checkpointing = 0;
+    file->checkpoint_failed = 0;
+    file->checkpointed = 0;
+    if (resume) {
+        char *path = file->name + name_len + 1;
+        memcpy(path, name, name_len);
+        memcpy(path + name_len, RESUME_SUFFIX, sizeof(RESUME_SUFFIX));
+        file->path = path;
+        memcpy(file->resume_id, resume_id, FRAME_RESUME_ID_SZ);
+    }
+    file->stripe = stripe;
+    file->base = base;
+    file->landed = 0;
+    if (stripe) {
+        file->path = stripe->path;
+        ++w->stripe_ranges;
+    }
+    file->fd = -1;
+    file->fixed = 0;
+    /* The connection's and the open's */
+    file->refs = 2;
+    file->inflight = 0;
+    file->off = base;
+    file->opened = w->now;
+    file->signature = conn->cold->signature;
+    file->opening = 1;
+    file->failed = 0;
+    file->write_failed = 0;
+    file->complete = 0;
+    file->ack_conn = 0x0;
+    file->size = size;
+    file->written = base;
+    file->kicked = base;
+    file->direct = file->odirect = backend == BACKEND_PLAIN && direct_threshold &&
+                                   size >= direct_threshold && !resume && !stripe;
+    file->cdc = 0x0;
+    if (backend == BACKEND_DEDUP && !stripe) {
+        file->cdc = zh_malloc(sizeof(*file->cdc));
+        file->cdc->buf = get_stage(w);
+        file->cdc->fill = 0;
+        file->cdc->hash = 0;
+        file->cdc->bytes = 0;
+        file->cdc->lost = 0;
+        file->cdc->lines = zh_malloc(MANIFEST_BUF);
+        file->cdc->lines_len = sprintf(file->cdc->lines, MANIFEST_MAGIC "\n");
+    }
+    file->stage_fill = 0;
+    file->tail_len = 0;
+    file->stage = 0x0;
+    file->tail = 0x0;
+    file->digest_bad = 0;
+    digest_init(&file->digest, digest);
+    w->direct_uploads += file->direct;
+    file->dir = dir;
+    ++dir->refs;
+    file->waiter = 0x0;
+    file->pending_head = file->pending_tail = 0x0;
+    if (dir->fd >= 0) {
+        submit_file_open(w, file);
+    } else if (dir->failed) {
+        /* Nothing to open in, the connection's reference stays */
+        file->opening = 0;
+        file->failed = 1;
+        file->resume = RESUME_NONE;
+        --file->refs;
+    } else {
+        file->next_waiting = dir->waiting;
+        dir->waiting = file;
+    }
+    return file;
+}
+
+/*
+ * Counts the data of req against conn's and the worker's budget and holds
+ * file until the write completes, release_file_write gives it all back.
+ * */
+
+void hold_write(worker *w, connection *conn, upload_file *file, struct request *req)
+{
+    uint64_t now, peak;
+    uint32_t len = req->iov[0].iov_len;
+    req->file = file;
+    ++file->refs;
+    ++file->inflight;
+    req->conn = conn;
+    req->read_at = w->now;
+    ++conn->writes_inflight;
+    conn->buffered += len;
+    if ((w->buffered += len) > w->buffered_peak)
+        w->buffered_peak = w->buffered;
+    now = __atomic_add_fetch(&buffered_bytes, len, __ATOMIC_RELAXED);
+    peak = __atomic_load_n(&buffered_peak, __ATOMIC_RELAXED);
+    while (now > peak &&
+           !__atomic_compare_exchange_n(&buffered_peak, &peak, now, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+/* Queues the write of req's data at file->off and moves off past it */
+void queue_file_write(worker *w, connection *conn, upload_file *file, struct request *req)
+{
+    uint32_t len = req->iov[0].iov_len;
+    hold_write(w, conn, file, req);
+    req->done = 0;
+    if (file->opening) {
+        req->next_pending = 0x0;
+        if (file->pending_tail) file->pending_tail->next_pending = req;
+        else file->pending_head = req;
+        file->pending_tail = req;
+    } else {
+        prep_file_write(w, get_sqe(w), file, req, file->off);
+    }
+    file->off += len;
+}
+
+/* Writes the first len bytes of file's staging chunk, which goes with the write */
+void flush_stage(worker *w, connection *conn, upload_file *file, uint32_t len)
+{
+    struct request *req = alloc_request(w, 1);
+    req->event_type = EVENT_TYPE_STAGE_OUT;
+    req->iov[0].iov_base = file->stage;
+    req->iov[0].iov_len = len;
+    file->stage = 0x0;
+    file->stage_fill = 0;
+    ++w->direct_writes;
+    queue_file_write(w, conn, file, req);
+}
+
+/*
+ * The upload is complete: the aligned part of the staging chunk is written
+ * as usual, the rest is kept back for write_tail.
+ * */
+
+void flush_tail(worker *w, connection *conn, upload_file *file)
+{
+    uint32_t aligned = file->stage_fill & ~(DIRECT_ALIGN - 1);
+    file->tail_len = file->stage_fill - aligned;
+    if (file->tail_len) {
+        file->tail = zh_malloc(file->tail_len);
+        memcpy(file->tail, file->stage + aligned, file->tail_len);
+    }
+    if (aligned) {
+        flush_stage(w, conn, file, aligned);
+    } else {
+        put_stage(w, file->stage);
+        file->stage = 0x0;
+        file->stage_fill = 0;
+    }
+    file->off += file->tail_len;
+}
+
+/* Copies payload of a direct upload that came in through a read buffer */
+void stage_data(worker *w, connection *conn, upload_file *file, const char *data, uint32_t len)
+{
+    while (len) {
+        if (!file->stage) file->stage = get_stage(w);
+        uint32_t n = DIRECT_CHUNK - file->stage_fill;
+        if (n > len) n = len;
+        memcpy(file->stage + file->stage_fill, data, n);
+        file->stage_fill += n;
+        data += n;
+        len -= n;
+        if (file->stage_fill == DIRECT_CHUNK) flush_stage(w, conn, file, DIRECT_CHUNK);
+    }
+}
+
+/* Gives back what a file write held, also for one dropped unsubmitted */
+void release_file_write(worker *w, struct request *req)
+{
+    connection *conn = req->conn;
+    uint32_t len = req->iov[0].iov_len;
+    --req->file->inflight;
+    checkpoint_file(w, req->file, 0);
+    put_file(w, req->file);
+    conn->buffered -= len;
+    w->buffered -= len;
+    __atomic_sub_fetch(&buffered_bytes, len, __ATOMIC_RELAXED);
+    --conn->writes_inflight;
+    /* Only its own writes can let a connection past its own limits */
+    if (conn->read_deferred == DEFER_OWN) settle_deferred(w, conn);
+    release_connection(conn);
+    resume_deferred(w);
+}
+
+/* A free slot is all zeros, no chunk hashes to that */
+int chunk_unused(const uint8_t *slot)
+{
+    static const uint8_t empty[SHA256_LEN];
+    return !memcmp(slot, empty, SHA256_LEN);
+}
+
+/* The slot of key in the chunk index, or the free one it would go in */
+uint8_t *chunk_slot(const uint8_t *key)
+{
+    uint64_t i;
+    memcpy(&i, key, sizeof(i));
+    for (i &= chunk_index_cap - 1; ; i = (i + 1) & (chunk_index_cap - 1))
+        if (!memcmp(chunk_index[i], key, SHA256_LEN) || chunk_unused(chunk_index[i]))
+            return chunk_index[i];
+}
+
+/* Doubles the chunk index, chunk_lock is held once the workers run */
+void grow_chunk_index()
+{
+    uint8_t (*old)[SHA256_LEN] = chunk_index;
+    uint64_t old_cap = chunk_index_cap;
+    chunk_index_cap = old_cap ? old_cap * 2 : CHUNK_INDEX_MIN;
+    chunk_index = calloc(chunk_index_cap, SHA256_LEN);
+    if (!chunk_index) fatal_error("calloc()");
+    for (uint64_t i = 0; i < old_cap; ++i)
+        if (!chunk_unused(old[i])) memcpy(chunk_slot(old[i]), old[i], SHA256_LEN);
+    free(old);
+}
+
+/* Adds key to the chunk index unless it is there, returns 1 if it was added */
+int chunk_insert(const uint8_t *key)
+{
+    uint8_t *slot = chunk_slot(key);
+    if (!chunk_unused(slot)) return 0;
+    memcpy(slot, key, SHA256_LEN);
+    if (++chunk_index_count * 4 > chunk_index_cap * 3) grow_chunk_index();
+    return 1;
+}
+
+/* The pending entry of key, or where it would be linked, chunk_lock held */
+chunk_pending **chunk_pending_slot(const uint8_t *key)
+{
+    chunk_pending **p = &chunks_pending[key[0] % CHUNK_PENDING_BUCKETS];
+    while (*p && memcmp((*p)->key, key, SHA256_LEN)) p = &(*p)->next;
+    return p;
+}
+
+/* A chunk wait of this worker ended, its write is given back */
+void chunk_waited(worker *w, struct request *req, int lost)
+{
+    if (lost) req->file->cdc->lost = 1;
+    release_file_write(w, req);
+    free_request(w, req);
+}
+
+/*
+ * The write of the chunk key ended, stored or not. A stored chunk moves
+ * from chunks_pending into the index, and the uploads waiting on it go on,
+ * on their own workers; they are lost with one that was not.
+ * */
+
+void chunk_settle(worker *w, const uint8_t *key, int stored)
+{
+    chunk_pending **p, *pending;
+    pthread_mutex_lock(&chunk_lock);
+    p = chunk_pending_slot(key);
+    pending = *p;
+    *p = pending->next;
+    if (stored) chunk_insert(key);
+    pthread_mutex_unlock(&chunk_lock);
+    while (pending->waiters) {
+        struct request *req = pending->waiters;
+        pending->waiters = req->next_pending;
+        if (req->client_socket == w->id) {
+            chunk_waited(w, req, !stored);
+        } else {
+            command *cmd = zh_malloc(sizeof(*cmd));
+            cmd->payload = 0x0;
+            cmd->waiter = req;
+            cmd->lost = !stored;
+            post_command(&workers[req->client_socket], cmd);
+        }
+    }
+    free(pending);
+}
+
+/* Queues the manifest lines collected so far as a write of the file */
+void flush_manifest(worker *w, connection *conn, upload_file *file)
+{
+    struct request *req = alloc_request(w, 1);
+    req->event_type = EVENT_TYPE_MANIFEST;
+    req->iov[0].iov_base = file->cdc->lines;
+    req->iov[0].iov_len = file->cdc->lines_len;
+    file->cdc->lines = zh_malloc(MANIFEST_BUF);
+    file->cdc->lines_len = 0;
+    queue_file_write(w, conn, file, req);
+}
+
+void close_chunk(worker *w, int fd)
+{
+    struct io_uring_sqe *sqe = get_sqe(w);
+    struct request *req = alloc_request(w, 0);
+    req->event_type = EVENT_TYPE_CHUNK_CLOSE;
+    io_uring_prep_close(sqe, fd);
+    io_uring_sqe_set_data(sqe, req);
+}
+
+/*
+ * The current chunk of file is complete. It goes into the manifest, and
+ * into the store unless the index has it: its buffer then goes with the
+ * write, the key and the chunk's paths stored behind the data, and the
+ * file gets a new one. A chunk another write is storing is waited on, the
+ * upload is not acked before it is in the store.
+ * */
+
+void emit_chunk(worker *w, connection *conn, upload_file *file)
+{
+    cdc_state *cdc = file->cdc;
+    uint8_t *key = cdc->buf + CDC_MAX;
+    char *path = (char *)key + SHA256_LEN;
+    char hex[2 * SHA256_LEN + 1];
+    struct sha256_ctx sha;
+    chunk_pending **p;
+    int fresh = 0;
+    sha256_init(&sha);
+    sha256_update(&sha, cdc->buf, cdc->fill);
+    sha256_final(&sha, key);
+    digest_hex(DIGEST_SHA256, key, hex);
+    if (cdc->lines_len > MANIFEST_BUF - MANIFEST_LINE_MAX) flush_manifest(w, conn, file);
+    cdc->lines_len += sprintf(cdc->lines + cdc->lines_len, "%s %u\n", hex, cdc->fill);
+    pthread_mutex_lock(&chunk_lock);
+    p = chunk_pending_slot(key);
+    if (*p) {
+        struct request *req = alloc_request(w, 1);
+        req->iov[0].iov_len = 0;
+        req->client_socket = w->id;
+        hold_write(w, conn, file, req);
+        req->next_pending = (*p)->waiters;
+        (*p)->waiters = req;
+    } else if (chunk_unused(chunk_slot(key))) {
+        *p = zh_malloc(sizeof(**p));
+        (*p)->next = 0x0;
+        memcpy((*p)->key, key, SHA256_LEN);
+        (*p)->waiters = 0x0;
+        fresh = 1;
+    }
+    pthread_mutex_unlock(&chunk_lock);
+    if (fresh) {
+        struct io_uring_sqe *sqe = get_sqe(w);
+        struct request *req = alloc_request(w, 1);
+        req->event_type = EVENT_TYPE_CHUNK_OPEN;
+        req->iov[0].iov_base = cdc->buf;
+        req->iov[0].iov_len = cdc->fill;
+        hold_write(w, conn, file, req);
+        sprintf(path, "%.2s/%s", hex, hex);
+        sprintf(path + CHUNK_PATH_SZ, "%.2s/%s" CHUNK_TMP_SUFFIX, hex, hex);
+        io_uring_prep_openat(sqe, chunk_dir_fd, path + CHUNK_PATH_SZ, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                             S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+        io_uring_sqe_set_data(sqe, req);
+        ++w->chunks_new;
+        w->chunk_bytes_new += cdc->fill;
+        cdc->buf = get_stage(w);
+    } else {
+        ++w->chunks_dup;
+        w->chunk_bytes_dup += cdc->fill;
+    }
+    cdc->fill = 0;
+    cdc->hash = 0;
+}
+
+/*
+ * Moves a chunk write along: the open of its .tmp file, the write, an
+ * fdatasync under a sync policy, then the rename to its name, with the
+ * close going out next to the rename. The chunk is settled after the
+ * rename; if any step failed it never gets into the index, and its upload
+ * is not stored.
+ * */
+
+void chunk_step(worker *w, struct request *req, int res)
+{
+    uint8_t *key = (uint8_t *)req->iov[0].iov_base + CDC_MAX;
+    char *path = (char *)key + SHA256_LEN;
+    struct io_uring_sqe *sqe;
+    int stored = 1;
+    if (res < 0 || (req->event_type == EVENT_TYPE_CHUNK_WRITE && res != req->iov[0].iov_len)) {
+        log_file(w, LOG_ERROR, req->file, "cannot store chunk", res < 0 ? -res : EIO);
+        if (req->event_type == EVENT_TYPE_CHUNK_WRITE || req->event_type == EVENT_TYPE_CHUNK_SYNC)
+            close_chunk(w, req->client_socket);
+        req->file->cdc->lost = 1;
+        ++w->chunk_errors;
+        req->event_type = EVENT_TYPE_CHUNK_RENAME;
+        stored = 0;
+    }
+    switch (req->event_type) {
+    case EVENT_TYPE_CHUNK_OPEN:
+        req->event_type = EVENT_TYPE_CHUNK_WRITE;
+        req->client_socket = res;
+        sqe = get_sqe(w);
+        if (w->arena_registered && in_arena(w, req->iov[0].iov_base)) {
+            io_uring_prep_write_fixed(sqe, res, req->iov[0].iov_base, req->iov[0].iov_len, 0, 0);
+            ++w->fixed_writes;
+        } else {
+            io_uring_prep_write(sqe, res, req->iov[0].iov_base, req->iov[0].iov_len, 0);
+        }
+        io_uring_sqe_set_data(sqe, req);
+        break;
+
+    case EVENT_TYPE_CHUNK_WRITE:
+        hist_record(&w->write_lat_hist, w->now - req->read_at);
+        w->bytes_written += res;
+        if (durability != DURABILITY_NONE) {
+            req->event_type = EVENT_TYPE_CHUNK_SYNC;
+            sqe = get_sqe(w);
+            io_uring_prep_fsync(sqe, req->client_socket, IORING_FSYNC_DATASYNC);
+            io_uring_sqe_set_data(sqe, req);
+            ++w->syncs;
+            break;
+        }
+        /* fall through */
+    case EVENT_TYPE_CHUNK_SYNC:
+        close_chunk(w, req->client_socket);
+        req->event_type = EVENT_TYPE_CHUNK_RENAME;
+        sqe = get_sqe(w);
+        io_uring_prep_renameat(sqe, chunk_dir_fd, path + CHUNK_PATH_SZ, chunk_dir_fd, path, 0);
+        io_uring_sqe_set_data(sqe, req);
+        break;
+
+    case EVENT_TYPE_CHUNK_RENAME:
+        chunk_settle(w, key, stored);
+        put_stage(w, req->iov[0].iov_base);
+        release_file_write(w, req);
+        free_request(w, req);
+        break;
+    }
+}
+
+/*
+ * Content-defined chunking, FastCDC style. A Gear hash rolls over the bytes
+ * of the current chunk past CDC_MIN and the chunk ends where its top bits
+ * are all zero, with a harder mask before CDC_AVG and an easier one after
+ * so sizes cluster around it, or at CDC_MAX. Returns how many of the len
+ * bytes belong to the current chunk, *cut is set if it ends with them.
+ * */
+
+uint32_t cdc_scan(cdc_state *cdc, const uint8_t *data, uint32_t len, int *cut)
+{
+    uint64_t hash = cdc->hash;
+    uint32_t fill = cdc->fill;
+    uint32_t i = 0;
+    *cut = 0;
+    if (fill < CDC_MIN) {
+        i = CDC_MIN - fill < len ? CDC_MIN - fill : len;
+        fill += i;
+    }
+    for (; i < len && fill < CDC_AVG; ++i, ++fill) {
+        hash = (hash << 1) + gear[data[i]];
+        if (!(hash & CDC_MASK_S)) {
+            *cut = 1;
+            ++i;
+            goto out;
+        }
+    }
+    for (; i < len; ++i) {
+        hash = (hash << 1) + gear[data[i]];
+        if (!(hash & CDC_MASK_L) || ++fill == CDC_MAX) {
+            *cut = 1;
+            ++i;
+            break;
+        }
+    }
+out:
+    cdc->hash = hash;
+    return i;
+}
+
+/* Copies payload of a deduplicated upload into its chunks */
+void chunk_data(worker *w, connection *conn, upload_file *file, const char *data, uint32_t len)
+{
+    cdc_state *cdc = file->cdc;
+    cdc->bytes += len;
+    while (len) {
+        int cut;
+        uint32_t n = cdc_scan(cdc, (const uint8_t *)data, len, &cut);
+        memcpy(cdc->buf + cdc->fill, data, n);
+        cdc->fill += n;
+        data += n;
+        len -= n;
+        if (cut) emit_chunk(w, conn, file);
+    }
+}
+
+/*
+ * Queues a write of len bytes at file->off. data points into read buffer
+ * bid, which stays out of the ring until the write completes. A direct
+ * upload copies the data into its staging chunk instead, a deduplicated
+ * one into its chunks.
+ * */
+
+void add_file_write(worker *w, connection *conn, upload_file *file,
+                    const char *data, uint32_t len, int bid)
+{
+    struct request *req;
+    /* The payload of a file that could not be opened is dropped */
+    if (file->failed) return;
+    if (file->digest.type) {
+        digest_update(&file->digest, data, len);
+        w->digested_bytes += len;
+    }
+    if (file->direct) {
+        stage_data(w, conn, file, data, len);
+        return;
+    }
+    if (file->cdc) {
+        chunk_data(w, conn, file, data, len);
+        return;
+    }
+    req = alloc_request(w, 1);
+    req->event_type = EVENT_TYPE_WRITE;
+    req->iov[0].iov_base = (char *)data;
+    req->iov[0].iov_len = len;
+    req->buf_id = bid;
+    ++w->buf_refs[bid];
+    queue_file_write(w, conn, file, req);
+}
+
+/*
+ * The whole upload was received. expected is the digest the client sent
+ * for it, or NULL.
+ * */
+
+void finish_upload(worker *w, connection *conn, const uint8_t *expected)
+{
+    upload_file *file = conn->file;
+    conn->isFileTransferring = 0;
+    if (file->stage) flush_tail(w, conn, file);
+    if (file->cdc && !file->failed) {
+        if (file->cdc->fill) emit_chunk(w, conn, file);
+        flush_manifest(w, conn, file);
+    }
+    if (file->digest.type) {
+        int len = digest_final(&file->digest, file->sum);
+        if (expected && memcmp(expected, file->sum, len)) {
+            file->digest_bad = 1;
+            ++w->digest_mismatches;
+            log_file(w, LOG_ERROR, file, "digest mismatch", 0);
+        }
+    }
+    conn->file->complete = 1;
+    /* Legacy clients do not expect anything back */
+    if (conn->proto == PROTO_FRAMED) {
+        conn->file->ack_conn = conn;
+        ++conn->acks_pending;
+    }
+    put_file(w, conn->file);
+    conn->file = 0x0;
+}
+
+/* A write of file failed: the upload is neither stored nor acked, logged once */
+void fail_file_write(worker *w, upload_file *file, int err)
+{
+    if (!file->write_failed) {
+        log_file(w, LOG_ERROR, file, "write failed", err);
+        ++w->write_errors;
+    }
+    file->write_failed = 1;
+}
+
+/*
+ * A write of req->file completed with res. Returns 1 once all of its data
+ * is written, or it failed; a short write goes out again for the rest, and
+ * returns 0 with req still in flight.
+ * */
+
+int file_write_done(worker *w, struct request *req, int res)
+{
+    if (res <= 0) {
+        fail_file_write(w, req->file, res ? -res : EIO);
+        return 1;
+    }
+    w->bytes_written += res;
+    if ((req->done += res) == req->iov[0].iov_len)
+        return 1;
+    prep_file_write(w, get_sqe(w), req->file, req, req->off);
+    return 0;
+}
+
+/* Completion of a queued file write, returns 0 if it is not done yet */
+int finish_file_write(worker *w, struct request *req, int res)
+{
+    int done = file_write_done(w, req, res);
+    if (res > 0) file_progress(w, req->file, res);
+    if (!done) return 0;
+    hist_record(&w->write_lat_hist, w->now - req->read_at);
+    release_file_write(w, req);
+    return 1;
+}
+
+/*
+ * The splice of conn's pipe into its file failed, what the pipe holds is
+ * dropped. Its read end does not block, returns an errno if the pipe holds
+ * less than pipe_pending.
+ * */
+
+int drain_pipe(connection *conn)
+{
+    char sink[4096];
+    uint32_t left = conn->pipe_pending;
+    while (left) {
+        ssize_t n = read(conn->pipefd[0], sink, left < sizeof(sink) ? left : sizeof(sink));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return n ? errno : EIO;
+        left -= n;
+    }
+    return 0;
+}
+
+/*
+ * Arms whatever comes next on the socket once the data just read is
+ * handled. A connection whose file is still opening reads nothing until
+ * the open completes, one whose file failed to open drops the upload.
+ * */
+
+void continue_reading(worker *w, connection *conn)
+{
+    upload_file *file = conn->file;
+    if (file && file->opening) {
+        file->waiter = conn;
+        return;
+    }
+    if (file && file->failed) {
+        /* Framed payloads are still read, and discarded, to find the next frame */
+        if (conn->proto == PROTO_FRAMED) conn->frame_remaining += conn->splice_remaining;
+        conn->splice_remaining = 0;
+        conn->isFileTransferring = 0;
+        put_file(w, file);
+        conn->file = 0x0;
+    }
+    /* Staged reads wait for writes to drain like buffered ones, splices need not */
+    if (conn->splice_remaining && !file->direct) add_splice_request(w, conn, EVENT_TYPE_SPLICE_IN);
+    else if (read_blocked(w, conn)) defer_read(w, conn);
+    else arm_read(w, conn);
+}
+
+void end_payload(worker *w, connection *conn);
+void bypass_buffers(connection *conn);
+
+/*
+ * Settles where a resumable upload goes on: its client, waiting for the
+ * open, is told with a FRAME_TYPE_OFFSET frame and sends the rest of the
+ * payload from there. Only called with a waiter and an open .part.
+ * */
+
+void resume_from(worker *w, upload_file *file, uint64_t off)
+{
+    connection *conn = file->waiter;
+    file->resume = RESUME_KNOWN;
+    file->off = file->written = file->kicked = file->checkpointed = off;
+    ++w->resumable;
+    if (off) {
+        ++w->resumed;
+        w->resumed_bytes += off;
+    }
+    send_offset(w, conn, file->name, off);
+    conn->frame_remaining = file->size - off;
+    conn->frame_state = FRAME_STATE_PAYLOAD;
+    if (!conn->frame_remaining) end_payload(w, conn);
+    else bypass_buffers(conn);
+}
+
+/* The .part of a resumable upload is open, the open's reference moves on to reading its record */
+void read_resume_record(worker *w, upload_file *file)
+{
+    struct io_uring_sqe *sqe = get_sqe(w);
+    struct request *req = alloc_request(w, 1);
+    req->event_type = EVENT_TYPE_RESUME_READ;
+    req->file = file;
+    req->iov[0].iov_base = zh_malloc(sizeof(struct resume_record));
+    req->iov[0].iov_len = sizeof(struct resume_record);
+    io_uring_prep_fgetxattr(sqe, file->fd, RESUME_XATTR, req->iov[0].iov_base,
+                            sizeof(struct resume_record));
+    if (file->fixed) sqe->flags |= IOSQE_FIXED_FILE;
+    io_uring_sqe_set_data(sqe, req);
+}
+
+void file_opened(worker *w, upload_file *file, int res);
+
+/*
+ * The record of a .part is read, -ENODATA if it has none. If it is of the
+ * same upload the upload goes on from what it says is durable, else the
+ * .part is opened again, truncated. If the client left meanwhile the .part
+ * is left as it is for its next attempt.
+ * */
+
+void resume_record_read(worker *w, struct request *req, int res)
+{
+    upload_file *file = req->file;
+    struct resume_record *rec = req->iov[0].iov_base;
+    uint64_t durable = le64toh(rec->durable);
+    if (res < 0 && res != -ENODATA)
+        log_file(w, LOG_ERROR, file, "cannot read resume record", -res);
+    if (!file->waiter) {
+        file_opened(w, file, file->fixed ? 0 : file->fd);
+    } else if (res == sizeof(*rec) && !memcmp(rec->id, file->resume_id, sizeof(rec->id)) &&
+               le64toh(rec->size) == file->size && durable <= file->size) {
+        resume_from(w, file, durable);
+        file_opened(w, file, file->fixed ? 0 : file->fd);
+    } else {
+        if (file->fixed) {
+            release_fixed_file(w, file->fd);
+            file->fixed = 0;
+        } else {
+            close(file->fd);
+        }
+        file->resume = RESUME_FRESH;
+        submit_file_open(w, file);
+    }
+    free(rec);
+    free_request(w, req);
+}
+
+/*
+ * Completion of a file's open: submits the writes queued on it from its
+ * base in order, or drops them, and lets a connection waiting on it go on. A
+ * resumable upload first settles its offset, its client sends nothing
+ * before; if it cannot be opened there is no offset to tell, and its
+ * connection is closed instead.
+ * */
+
+void file_opened(worker *w, upload_file *file, int res)
+{
+    if (res == -EINVAL && file->odirect) {
+        /* The filesystem has no O_DIRECT, the chunks go through the page cache */
+        log_file(w, LOG_ERROR, file, "no O_DIRECT, writing buffered", EINVAL);
+        file->odirect = 0;
+        submit_file_open(w, file);
+        return;
+    }
+    int unresolved = file->resume == RESUME_LOOKUP || file->resume == RESUME_FRESH;
+    if (file->resume == RESUME_LOOKUP && res >= 0 && file->waiter) {
+        if (!file->fixed) file->fd = res;
+        read_resume_record(w, file);
+        return;
+    }
+    if (unresolved) {
+        if (res >= 0 && file->waiter) resume_from(w, file, 0);
+        else file->resume = RESUME_NONE;
+    }
+    connection *waiter = file->waiter;
+    struct request *req = file->pending_head;
+    file->opening = 0;
+    file->waiter = 0x0;
+    file->pending_head = file->pending_tail = 0x0;
+    if (res < 0) {
+        log_file(w, LOG_ERROR, file, "cannot open", -res);
+        file->failed = 1;
+        while (req) {
+            struct request *next = req->next_pending;
+            if (req->event_type == EVENT_TYPE_STAGE_OUT) put_stage(w, req->iov[0].iov_base);
+            else if (req->event_type == EVENT_TYPE_MANIFEST) free(req->iov[0].iov_base);
+            else put_buffer(w, req->buf_id);
+            release_file_write(w, req);
+            free_request(w, req);
+            req = next;
+        }
+    } else {
+        uint64_t off = file->base;
+        /* A direct open returns 0, the slot was picked beforehand */
+        if (!file->fixed) file->fd = res;
+        log_file(w, LOG_OPEN, file, 0x0, 0);
+        if (file->size && !file->cdc) {
+            /* Reserve the extents up front, the size still grows with the writes */
+            struct io_uring_sqe *sqe = get_sqe(w);
+            struct request *falloc = alloc_request(w, 0);
+            falloc->event_type = EVENT_TYPE_FALLOCATE;
+            falloc->file = file;
+            ++file->refs;
+            io_uring_prep_fallocate(sqe, file->fd, FALLOC_FL_KEEP_SIZE, file->base, file->size);
+            if (file->fixed) sqe->flags |= IOSQE_FIXED_FILE;
+            io_uring_sqe_set_data(sqe, falloc);
+        }
+        while (req) {
+            struct request *next = req->next_pending;
+            prep_file_write(w, get_sqe(w), file, req, off);
+            off += req->iov[0].iov_len;
+            req = next;
+        }
+    }
+    put_file(w, file);
+    if (waiter && unresolved && res < 0) close_connection(w, waiter);
+    else if (waiter) continue_reading(w, waiter);
+}
+
+/* Completion of a directory's open, the files waiting on it can be opened */
+void dir_opened(worker *w, dir_entry *dir, int res)
+{
+    if (res < 0) {
+        log_record *rec = log_begin(w, LOG_ERROR);
+        if (rec) {
+            rec->addr = dir->addr;
+            rec->what = "cannot open directory";
+            rec->err = -res;
+            log_commit(w);
+        }
+        dir->failed = 1;
+    } else {
+        dir->fd = res;
+    }
+    /* Failed files drop their references, keep it until done */
+    ++dir->refs;
+    while (dir->waiting) {
+        upload_file *file = dir->waiting;
+        dir->waiting = file->next_waiting;
+        if (res < 0) file_opened(w, file, res);
+        else submit_file_open(w, file);
+    }
+    put_dir(w, dir);
+}
+
+/*
+ * Upload headers may carry the payload size after the name:
+ *   \xfe\xdf\x10\x02START_OF_FILE<name>\0<decimal size>\0
+ * Returns the size, or 0 if it is missing or malformed, and stores where the
+ * payload starts in *consumed.
+ * */
+
+uint64_t parse_payload_size(const char *data, int32_t sz, int name_end, int *consumed)
+{
+    const char *p = data + name_end + 1;
+    const char *end;
+    char *digits_end;
+    uint64_t size;
+    if (name_end >= sz || data[name_end] != '\0') return 0;
+    end = memchr(p, '\0', data + sz - p);
+    if (!end || end == p || !isdigit((unsigned char)*p)) return 0;
+    size = strtoull(p, &digits_end, 10);
+    if (digits_end != end) return 0;
+    *consumed = end + 1 - data;
+    return size;
+}
+
+/* Uploads whose bytes the server has to see are never spliced */
+int spliceable(upload_file *file)
+{
+    return !file->digest.type && !file->cdc;
+}
+
+/* The digest algorithm of a frame, DIGEST_NONE if it carries no trailer */
+uint8_t frame_digest(const struct frame_header *hdr)
+{
+    return hdr->flags & FRAME_FLAG_CRC32C ? DIGEST_CRC32C :
+           hdr->flags & FRAME_FLAG_SHA256 ? DIGEST_SHA256 : DIGEST_NONE;
+}
+
+/*
+ * The payload of the current frame is in, the upload ends here or once its
+ * trailer is collected behind the name in frame_buf.
+ * */
+
+void end_payload(worker *w, connection *conn)
+{
+    if (frame_digest((struct frame_header *)conn->cold->frame_buf)) {
+        conn->frame_state = FRAME_STATE_TRAILER;
+        return;
+    }
+    if (conn->file) finish_upload(w, conn, 0x0);
+    conn->frame_state = FRAME_STATE_HEADER;
+    conn->frame_have = 0;
+}
+
+/*
+ * Hands the socket over to the splice path for the next size bytes of the
+ * current upload, which are written from file->off on. Returns 0 if the pipe
+ * cannot be set up, the bytes then go through the buffered path.
+ * */
+
+int start_splice(connection *conn, uint64_t size)
+{
+    if (conn->pipefd[0] == -1) {
+        if (pipe2(conn->pipefd, O_CLOEXEC) < 0) {
+            conn->pipefd[0] = conn->pipefd[1] = -1;
+            return 0;
+        }
+        fcntl(conn->pipefd[1], F_SETPIPE_SZ, SPLICE_SZ);
+        /* Splices out only run with bytes in the pipe, see drain_pipe() */
+        fcntl(conn->pipefd[0], F_SETFL, O_NONBLOCK);
+    }
+    conn->splice_remaining = size;
+    conn->pipe_pending = 0;
+    return 1;
+}
+
+void finish_splice(worker *w, connection *conn)
+{
+    if (conn->proto == PROTO_FRAMED)
+        end_payload(w, conn);
+    /* Legacy uploads append anything past the announced size from the read
+     * buffers, the next read waits for the writes like any other */
+    continue_reading(w, conn);
 }
 
-uint32_t handle_client_data(connection* conn, struct request *req, int32_t sz)
+/*
+ * Legacy uploads are delimited by magic markers that must sit at the start
+ * of a read: \xfe\xdf\x10\x02START_OF_FILE<name> opens the file and
+ * \xff\xff\xff\xff eof closes it, everything read in between is appended.
+ * With -k the eof marker may carry the hex digest of the file to check.
+ * */
+
+void handle_legacy_data(worker *w, connection* conn, struct request *req, int32_t sz)
 {
-    struct request *write_req = zh_malloc(sizeof(*req) + sizeof(struct iovec));
-    write_req->iov[0].iov_base = zh_malloc(WRITE_SZ);
-    write_req->iov[0].iov_len = WRITE_SZ ? sz : WRITE_SZ <= sz;
-    write_req->iovec_count = 1;
+    const char *data = req->iov[0].iov_base;
     //fprintf(stderr, "Hmmm %d\n", sz);
     // indicating client start sending a file to server
-    if (!strncmp(req->iov[0].iov_base, "\xfe\xdf\x10\x02START_OF_FILE", strlen("\xfe\xdf\x10\x02START_OF_FILE")))
+    if (sz >= strlen("\xfe\xdf\x10\x02START_OF_FILE") && !strncmp(data, "\xfe\xdf\x10\x02START_OF_FILE", strlen("\xfe\xdf\x10\x02START_OF_FILE")))
     {
         if (conn->isFileTransferring)
         {
@@ -213,45 +3365,44 @@ uint32_t handle_client_data(connection* conn, struct request *req, int32_t sz)
         }
         else
         {
-            if (req->iov[0].iov_len - strlen("\xfe\xdf\x10\x02START_OF_FILE") > strlen(req->iov[0].iov_base + strlen("\xfe\xdf\x10\x02START_OF_FILE")))
+            /* Pooled buffers are not zeroed, so the name is bounded by the read size */
+            int name_len = strnlen(data + strlen("\xfe\xdf\x10\x02START_OF_FILE"), sz - strlen("\xfe\xdf\x10\x02START_OF_FILE"));
+            int consumed = sz;
+            uint64_t payload_size = parse_payload_size(data, sz,
+                                                       strlen("\xfe\xdf\x10\x02START_OF_FILE") + name_len,
+                                                       &consumed);
+            if (name_len)
             {
-                char transferingFile[0x100];
-                snprintf(transferingFile,
-                        sizeof(transferingFile),
-                        "./%s/%s",
-                        conn->containedFolder,
-                        (char *)req->iov[0].iov_base + strlen("\xfe\xdf\x10\x02START_OF_FILE")
-                        );
-                conn->filefd = open(transferingFile,
-                                    O_WRONLY | O_CREAT | O_TRUNC | O_APPEND,
-                                    S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
-                if (conn->filefd == -1)
-                {
-                    printf("%s\n", transferingFile);
-                    printf("%s\n", conn->containedFolder);
-                    return 0;
-                    //fatal_error("wtf????");
-                }
+                conn->file = open_upload(w, conn, data + strlen("\xfe\xdf\x10\x02START_OF_FILE"), name_len,
+                                         payload_size, default_digest, 0x0, 0x0, 0);
                 //printf("start!!!\n");
-                printf("Recving to %s\n", transferingFile);
                 conn->isFileTransferring = 1;
-                // start now!!!
-                conn->start = clock();
-                return 0;
+                /* Payload bytes that arrived with the header go through the
+                 * buffered path, the rest of the announced size is spliced
+                 * in behind them if the pipe can be set up */
+                uint64_t leftover = sz - consumed;
+                if (payload_size > leftover && conn->file->direct)
+                    conn->splice_remaining = payload_size - leftover;
+                else if (payload_size > leftover && transfer_mode == TRANSFER_SPLICE && spliceable(conn->file))
+                    start_splice(conn, payload_size - leftover);
+                if (leftover)
+                    add_file_write(w, conn, conn->file, data + consumed, leftover, req->buf_id);
+                return;
             }
         }
     }
-    else if (!strncmp(req->iov[0].iov_base, "\xff\xff\xff\xff eof", 8))
+    else if (sz >= 8 && !strncmp(data, "\xff\xff\xff\xff eof", 8))
     {
         if (conn->isFileTransferring)
         {
             //printf("done!!!\n");
-            printf("done in %.16f\n", (double)((double)(clock() - conn->start) / CLOCKS_PER_SEC));
-            conn->start = 0;
-            conn->isFileTransferring = 0;
-            close(conn->filefd);
-            conn->filefd = -1;
-            return 0;
+            /* The marker may be followed by the hex digest of the file */
+            uint8_t expected[DIGEST_MAX];
+            int len = digest_len(conn->file->digest.type);
+            int verify = len && sz >= 8 + 2 * len &&
+                         digest_parse_hex(conn->file->digest.type, data + 8, expected);
+            finish_upload(w, conn, verify ? expected : 0x0);
+            return;
         }
         else
         {
@@ -262,99 +3413,610 @@ uint32_t handle_client_data(connection* conn, struct request *req, int32_t sz)
     {
         if (conn->isFileTransferring) goto FILE_TRANSFER;
         NORMAL_TRANSFER:
-            return 0;
+            return;
     }
     FILE_TRANSFER:
-        memcpy(write_req->iov[0].iov_base, req->iov[0].iov_base, WRITE_SZ ? sz : WRITE_SZ <= sz);
-        write_req->client_socket = conn->filefd;
-        add_write_request(write_req);
+        add_file_write(w, conn, conn->file, data, sz, req->buf_id);
+}
+
+/* Big payloads bypass the read buffers once the current read is consumed */
+void bypass_buffers(connection *conn)
+{
+    if (conn->frame_state == FRAME_STATE_PAYLOAD && conn->file && conn->file->direct) {
+        conn->splice_remaining = conn->frame_remaining;
+        conn->frame_remaining = 0;
+    } else if (conn->frame_state == FRAME_STATE_PAYLOAD && conn->file && spliceable(conn->file) &&
+               transfer_mode == TRANSFER_SPLICE && conn->frame_remaining >= SPLICE_SZ &&
+               start_splice(conn, conn->frame_remaining)) {
+        conn->frame_remaining = 0;
+    }
+}
+
+/*
+ * Framed uploads are a stream of
+ *   frame_header | name (name_len bytes) | payload (length bytes) | digest
+ * where the digest is only there if a FRAME_FLAG_ of one is set. A
+ * resumable one has its content ID in place of the digest, right after the
+ * name, and its payload only starts at the offset the server answers with.
+ * parsed incrementally, so frames may be split across reads or packed
+ * several to a read and clients can pipeline files without pauses. Header
+ * name and digest bytes are collected in conn->cold->frame_buf, payload bytes are written
+ * straight from the read buffer. Returns 0 on a protocol error.
+ * */
+
+int handle_framed_data(worker *w, connection *conn, struct request *req, int32_t sz)
+{
+    const char *data = req->iov[0].iov_base;
+    char *frame_buf = conn->cold->frame_buf;
+    struct frame_header *hdr = (struct frame_header *)frame_buf;
+    struct frame_stripe *ext;
+    int32_t pos = 0;
+    while (pos < sz) {
+        uint16_t name_len = le16toh(hdr->name_len);
+        int32_t n;
+        switch (conn->frame_state) {
+        case FRAME_STATE_HEADER:
+            n = sizeof(*hdr) - conn->frame_have;
+            if (n > sz - pos) n = sz - pos;
+            memcpy(frame_buf + conn->frame_have, data + pos, n);
+            conn->frame_have += n;
+            pos += n;
+            if (conn->frame_have < sizeof(*hdr))
+                break;
+            /* At most one flag, resumable and striped uploads carry no digest */
+            if (memcmp(hdr->magic, FRAME_MAGIC, sizeof(hdr->magic)) ||
+                hdr->type != FRAME_TYPE_FILE || !le16toh(hdr->name_len) ||
+                le16toh(hdr->name_len) > FRAME_NAME_MAX ||
+                hdr->flags & ~(FRAME_FLAG_CRC32C | FRAME_FLAG_SHA256 | FRAME_FLAG_RESUME | FRAME_FLAG_STRIPE) ||
+                hdr->flags & (hdr->flags - 1))
+                return 0;
+            conn->frame_state = FRAME_STATE_NAME;
+            break;
+
+        case FRAME_STATE_NAME:
+            n = sizeof(*hdr) + name_len - conn->frame_have;
+            if (n > sz - pos) n = sz - pos;
+            memcpy(frame_buf + conn->frame_have, data + pos, n);
+            conn->frame_have += n;
+            pos += n;
+            if (conn->frame_have < sizeof(*hdr) + name_len)
+                break;
+            /* Uploads stay inside the peer's folder */
+            if (memchr(frame_buf + sizeof(*hdr), '/', name_len) ||
+                memchr(frame_buf + sizeof(*hdr), '\0', name_len))
+                return 0;
+            if (hdr->flags & FRAME_FLAG_RESUME) {
+                conn->frame_state = FRAME_STATE_RESUME_ID;
+                break;
+            }
+            if (hdr->flags & FRAME_FLAG_STRIPE) {
+                conn->frame_state = FRAME_STATE_STRIPE;
+                break;
+            }
+            /* If the file cannot be opened its payload is still consumed */
+            conn->file = open_upload(w, conn, frame_buf + sizeof(*hdr), name_len, le64toh(hdr->length),
+                                     frame_digest(hdr) ? frame_digest(hdr) : default_digest, 0x0, 0x0, 0);
+            conn->frame_remaining = le64toh(hdr->length);
+            conn->frame_state = FRAME_STATE_PAYLOAD;
+            break;
+
+        case FRAME_STATE_RESUME_ID:
+            n = sizeof(*hdr) + name_len + FRAME_RESUME_ID_SZ - conn->frame_have;
+            if (n > sz - pos) n = sz - pos;
+            memcpy(frame_buf + conn->frame_have, data + pos, n);
+            conn->frame_have += n;
+            pos += n;
+            if (conn->frame_have < sizeof(*hdr) + name_len + FRAME_RESUME_ID_SZ)
+                break;
+            /* A resumed upload could only be digested from its offset on, so none is */
+            conn->file = open_upload(w, conn, frame_buf + sizeof(*hdr), name_len, le64toh(hdr->length),
+                                     DIGEST_NONE, (uint8_t *)frame_buf + sizeof(*hdr) + name_len, 0x0, 0);
+            if (conn->file->resume) {
+                /* Waits from now on, whether or not the read ends here */
+                conn->file->waiter = conn;
+                conn->frame_state = FRAME_STATE_OFFSET;
+                break;
+            }
+            /* Nothing to resume from, the whole payload follows */
+            send_offset(w, conn, conn->file->name, 0);
+            conn->frame_remaining = le64toh(hdr->length);
+            conn->frame_state = FRAME_STATE_PAYLOAD;
+            break;
+
+        case FRAME_STATE_OFFSET:
+            /* The client has to wait for the offset */
+            return 0;
+
+        case FRAME_STATE_STRIPE:
+            n = sizeof(*hdr) + name_len + sizeof(*ext) - conn->frame_have;
+            if (n > sz - pos) n = sz - pos;
+            memcpy(frame_buf + conn->frame_have, data + pos, n);
+            conn->frame_have += n;
+            pos += n;
+            if (conn->frame_have < sizeof(*hdr) + name_len + sizeof(*ext))
+                break;
+            ext = (struct frame_stripe *)(frame_buf + sizeof(*hdr) + name_len);
+            if (le64toh(ext->offset) > le64toh(ext->size) ||
+                le64toh(hdr->length) > le64toh(ext->size) - le64toh(ext->offset))
+                return 0;
+            /* The same transfer ID for another file is a client error */
+            stripe *s = get_stripe(conn->cold->dir->addr, ext, frame_buf + sizeof(*hdr), name_len);
+            if (!s) return 0;
+            conn->file = open_upload(w, conn, frame_buf + sizeof(*hdr), name_len, le64toh(hdr->length),
+                                     DIGEST_NONE, 0x0, s, le64toh(ext->offset));
+            conn->frame_remaining = le64toh(hdr->length);
+            conn->frame_state = FRAME_STATE_PAYLOAD;
+            break;
+
+        case FRAME_STATE_PAYLOAD:
+            n = conn->frame_remaining < (uint64_t)(sz - pos) ? conn->frame_remaining : sz - pos;
+            if (n && conn->file)
+                add_file_write(w, conn, conn->file, data + pos, n, req->buf_id);
+            conn->frame_remaining -= n;
+            pos += n;
+            break;
+
+        case FRAME_STATE_TRAILER:
+            n = sizeof(*hdr) + name_len + digest_len(frame_digest(hdr)) - conn->frame_have;
+            if (n > sz - pos) n = sz - pos;
+            memcpy(frame_buf + conn->frame_have, data + pos, n);
+            conn->frame_have += n;
+            pos += n;
+            if (conn->frame_have < sizeof(*hdr) + name_len + digest_len(frame_digest(hdr)))
+                break;
+            if (conn->file) finish_upload(w, conn, (uint8_t *)frame_buf + sizeof(*hdr) + name_len);
+            conn->frame_state = FRAME_STATE_HEADER;
+            conn->frame_have = 0;
+            break;
+        }
+        if (conn->frame_state == FRAME_STATE_PAYLOAD && !conn->frame_remaining)
+            end_payload(w, conn);
+    }
+    bypass_buffers(conn);
+    return 1;
+}
+
+/*
+ * The first bytes of a connection pick its protocol: FRAME_MAGIC selects the
+ * framed protocol, anything else the legacy markers. Returns 0 if the
+ * connection has to be dropped.
+ * */
+
+int handle_client_data(worker *w, connection* conn, struct request *req, int32_t sz)
+{
+    if (conn->proto == PROTO_UNKNOWN) {
+        int n = sz < FRAME_MAGIC_SZ ? sz : FRAME_MAGIC_SZ;
+        conn->proto = memcmp(req->iov[0].iov_base, FRAME_MAGIC, n) ? PROTO_LEGACY : PROTO_FRAMED;
+    }
+    if (conn->proto == PROTO_LEGACY) {
+        handle_legacy_data(w, conn, req, sz);
+    } else if (!handle_framed_data(w, conn, req, sz)) {
+        log_conn(w, LOG_ERROR, conn, "malformed frame", 0);
         return 0;
+    }
+    return 1;
 }
 
-void server_loop(int server_socket) {
-    struct io_uring_cqe *cqe;
-    int peek;
-    struct sockaddr_in client_addr;
-    socklen_t client_addr_len = sizeof(client_addr);
+/*
+ * Queues the broadcast commands waiting in this worker's mailbox as socket
+ * writes to every connection of this worker. The writes all point at the
+ * shared payload and go out with the loop's next submit. The worker's own
+ * reference keeps the payload alive until the writes have taken theirs.
+ * Chunk waits settled by other workers are given back on the way.
+ * */
 
-    add_accept_request(server_socket, &client_addr, &client_addr_len);
-    while (1) {
-        //peek = io_uring_peek_cqe(&ring, &cqe);
-        //if (peek) continue;
-        int ret = io_uring_wait_cqe(&ring, &cqe);
-        if (ret < 0)
-            fatal_error("io_uring_wait_cqe");
-        struct request *req = (struct request *) cqe->user_data;
+void handle_commands(worker *w)
+{
+    command *list = __atomic_exchange_n(&w->mailbox, 0x0, __ATOMIC_ACQUIRE);
+    command *reversed = 0x0;
+    /* The mailbox is a stack, restore the order the commands were given in */
+    while (list) {
+        command *next = list->next;
+        list->next = reversed;
+        reversed = list;
+        list = next;
+    }
+    while (reversed) {
+        command *cmd = reversed;
+        broadcast *payload = cmd->payload;
+        uint32_t sent = 0;
+        reversed = cmd->next;
+        if (cmd->waiter) {
+            chunk_waited(w, cmd->waiter, cmd->lost);
+            free(cmd);
+            continue;
+        }
+        for (uint32_t conn = 0; conn < w->conns_cap; ++conn)
+        {
+            if (w->conns_list[conn])
+            {
+                struct request *req = alloc_request(w, 1);
+                req->iov[0].iov_base = payload->text;
+                req->iov[0].iov_len = payload->len;
+                req->client_socket = w->conns_list[conn]->sockfd;
+                req->broadcast = payload;
+                add_write_request(w, req);
+                ++sent;
+            }
+        }
+        /* Completions are only reaped by this thread, after this returns */
+        if (sent) __atomic_add_fetch(&payload->refs, sent, __ATOMIC_RELAXED);
+        put_broadcast(w, payload);
+        free(cmd);
+    }
+}
+
+void handle_completion(worker *w, struct io_uring_cqe *cqe) {
+    struct request *req = (struct request *) cqe->user_data;
+    ++w->cqes[req->event_type];
+    if (req->event_type == EVENT_TYPE_READ || req->event_type == EVENT_TYPE_SPLICE_IN ||
+        req->event_type == EVENT_TYPE_STAGE_IN)
+        req->conn->read_armed = 0;
+    if (req->event_type == EVENT_TYPE_READ && cqe->res == -ENOBUFS) {
+        /* Every buffer is waiting on a disk write, retry once one is recycled.
+         * A buffer may also have been recycled after this read was issued. */
+        if (w->buf_available) add_read_request(w, req->conn);
+        else park_starved(w, req->conn);
+        free_request(w, req);
+        return;
+    }
+    if ((req->event_type == EVENT_TYPE_READ || req->event_type == EVENT_TYPE_SPLICE_IN ||
+         req->event_type == EVENT_TYPE_STAGE_IN) && cqe->res < 0) {
+        /* A client closing with acks unread resets the connection */
+        log_conn(w, LOG_ERROR, req->conn, "receive failed", -cqe->res);
+        close_connection(w, req->conn);
+        free_request(w, req);
+        return;
+    }
+    if (req->event_type == EVENT_TYPE_ACCEPT && cqe->res < 0) {
+        /* Out of fds or an aborted handshake, keep listening */
+        log_record *rec = log_begin(w, LOG_ERROR);
+        if (rec) {
+            rec->what = "accept failed";
+            rec->err = -cqe->res;
+            log_commit(w);
+        }
+        if (!(cqe->flags & IORING_CQE_F_MORE)) {
+            add_accept_request(w, req->buf_id);
+            free_request(w, req);
+        }
+        return;
+    }
+    if (req->event_type == EVENT_TYPE_TICK) {
+        /* -ETIME is the timeout firing */
+        wheel_advance(w);
+        add_tick_request(w);
+        free_request(w, req);
+        return;
+    }
+    if (req->event_type == EVENT_TYPE_SHUTDOWN || req->event_type == EVENT_TYPE_UNLINK) {
+        /* The peer may have reset the socket, or removed the file, first */
+        if (req->file) put_file(w, req->file);
+        free_request(w, req);
+        return;
+    }
+    if (req->event_type == EVENT_TYPE_MKDIR) {
+        /* Usually -EEXIST, the open linked behind it tells */
+        free_request(w, req);
+        return;
+    }
+    if (req->event_type == EVENT_TYPE_OPEN_DIR) {
+        dir_opened(w, req->dir, cqe->res);
+        free_request(w, req);
+        return;
+    }
+    if (req->event_type == EVENT_TYPE_OPEN_FILE) {
+        file_opened(w, req->file, cqe->res);
+        free_request(w, req);
+        return;
+    }
+    if (req->event_type == EVENT_TYPE_FALLOCATE || req->event_type == EVENT_TYPE_SYNC_RANGE) {
+        /* Only hints, the writes and the final sync do not depend on them */
+        put_file(w, req->file);
+        free_request(w, req);
+        return;
+    }
+    if (req->event_type == EVENT_TYPE_FSYNC) {
+        upload_file *file = req->file;
+        hist_record(&w->sync_hist, w->now - file->done_at);
         if (cqe->res < 0) {
-            fprintf(stderr, "Async request failed: %s for event: %d\n",
-                    strerror(-cqe->res), req->event_type);
-            exit(1);
+            log_file(w, LOG_ERROR, file, "fsync failed", -cqe->res);
+            ++w->sync_errors;
+        }
+        release_file(w, file, cqe->res >= 0);
+        free_request(w, req);
+        return;
+    }
+    if (req->event_type == EVENT_TYPE_GROUP_COMMIT) {
+        /* -ETIME is the window closing */
+        group_commit(w);
+        free_request(w, req);
+        return;
+    }
+    if (req->event_type == EVENT_TYPE_ACK) {
+        /* A client that went away misses its ack */
+        free(req->iov[0].iov_base);
+        put_ack(w, req->conn);
+        free_request(w, req);
+        return;
+    }
+    if (req->event_type == EVENT_TYPE_SIDECAR_OPEN) {
+        sidecar_opened(w, req, cqe->res);
+        return;
+    }
+    if (req->event_type == EVENT_TYPE_SIDECAR_WRITE) {
+        if (cqe->res < 0) {
+            log_record *rec = log_begin(w, LOG_ERROR);
+            if (rec) {
+                rec->what = "cannot write digest";
+                rec->err = -cqe->res;
+                strncpy(rec->name, req->iov[0].iov_base, LOG_NAME_SZ - 1);
+                log_commit(w);
+            }
         }
+        free(req->iov[0].iov_base);
+        free_request(w, req);
+        return;
+    }
+    if (req->event_type == EVENT_TYPE_SIDECAR_CLOSE || req->event_type == EVENT_TYPE_CHUNK_CLOSE) {
+        free_request(w, req);
+        return;
+    }
+    if (req->event_type >= EVENT_TYPE_CHUNK_OPEN && req->event_type <= EVENT_TYPE_CHUNK_RENAME) {
+        chunk_step(w, req, cqe->res);
+        return;
+    }
+    if (req->event_type == EVENT_TYPE_RESUME_READ) {
+        resume_record_read(w, req, cqe->res);
+        return;
+    }
+    if (req->event_type == EVENT_TYPE_CHECKPOINT_SYNC) {
+        if (cqe->res < 0) log_file(w, LOG_ERROR, req->file, "checkpoint sync failed", -cqe->res);
+        free_request(w, req);
+        return;
+    }
+    if (req->event_type == EVENT_TYPE_CHECKPOINT) {
+        checkpoint_done(w, req, cqe->res);
+        return;
+    }
+    if (req->event_type == EVENT_TYPE_CLOSE_SLOT) {
+        /*
+         * Socket slots are handed out again by the kernel, upload file
+         * slots by the worker, and not before the file in them is gone
+         */
+        if (req->buf_id >= (int)max_conn) w->file_slots[w->file_slots_top++] = req->buf_id;
+        free_request(w, req);
+        return;
+    }
+    if (req->event_type == EVENT_TYPE_PART_RENAME) {
+        upload_file *file = req->file;
+        if (cqe->res < 0) log_file(w, LOG_ERROR, file, "cannot rename", -cqe->res);
+        file->resume = RESUME_NONE;
+        release_file(w, file, cqe->res >= 0);
+        free_request(w, req);
+        return;
+    }
+    if (req->event_type == EVENT_TYPE_WRITE && !req->file && cqe->res < 0) {
+        /* The client went away before its broadcast was sent */
+        put_broadcast(w, req->broadcast);
+        free_request(w, req);
+        return;
+    }
+    /* A failed file write only fails its upload, see the cases below */
+    if (cqe->res < 0 && !req->file && req->event_type != EVENT_TYPE_SPLICE_OUT) {
+        fprintf(stderr, "Async request failed: %s for event: %d\n",
+                strerror(-cqe->res), req->event_type);
+        exit(1);
+    }
 
-        switch (req->event_type) {
-            case EVENT_TYPE_ACCEPT:
-                // add mutex lock right here
-                pthread_mutex_lock(&mutex);
-                handleNewConn(cqe->res, &client_addr);
-                add_accept_request(server_socket, &client_addr, &client_addr_len);
-                free(req);
-                pthread_mutex_unlock(&mutex);
-                break;
+    switch (req->event_type) {
+        case EVENT_TYPE_ACCEPT:
+            handleNewConn(w, cqe->res, fixed_files ? &w->accept_addrs[req->buf_id] : NULL);
+            if (!(cqe->flags & IORING_CQE_F_MORE)) {
+                add_accept_request(w, req->buf_id);
+                free_request(w, req);
+            }
+            break;
 
 
-            case EVENT_TYPE_READ:
-                if (!cqe->res) {
-                    fprintf(stderr, "Client %lx closed connection\n", req->signature);
-                    // add mutex lock right here
-                    pthread_mutex_lock(&mutex);
-                    for (uint32_t conn = 0; conn < MAX_CONN; ++conn)
-                    {
-                        if (conns_list[conn] && conns_list[conn]->signature == req->signature)
-                        {
-                            connection *_ = conns_list[conn];
-                            conns_list[conn] = 0x0;
-                            close(_->sockfd);
-                            if (_->filefd != -1) close(_->filefd);
-                            free(_);
-                            --curr_connection;
-                            break;
-                        }
-                    }
-                    pthread_mutex_unlock(&mutex);
+        case EVENT_TYPE_READ:
+            if (cqe->flags & IORING_CQE_F_BUFFER) {
+                req->buf_id = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+                req->iov[0].iov_base = w->buf_pool + (size_t)req->buf_id * buf_size;
+                req->iov[0].iov_len = cqe->res;
+                w->buf_refs[req->buf_id] = 1;
+                --w->buf_available;
+                w->bytes_read += cqe->res;
+            }
+            if (!cqe->res) {
+                if (req->buf_id != -1) put_buffer(w, req->buf_id);
+                peer_finished(w, req->conn);
+                free_request(w, req);
+                break;
+            }
+            else 
+            {
+                connection *_ = req->conn;
+                int keep = handle_client_data(w, _, req, cqe->res);
+                /* Drop our reference before re-arming so this read can reuse
+                 * the buffer if no write kept it */
+                put_buffer(w, req->buf_id);
+                if (!keep) {
+                    close_connection(w, _);
+                    free_request(w, req);
                     break;
                 }
-                else 
-                {
-                    for (uint32_t conn = 0; conn < MAX_CONN; ++conn)
-                    {
-                        if (conns_list[conn] && conns_list[conn]->signature == req->signature)
-                        {
-                            connection *_ = conns_list[conn];
-                            handle_client_data(_, req, cqe->res);
-                            add_read_request(_);
-                            break;
-                        }
-                    }
-                }
-                free(req->iov[0].iov_base);
-                req->iov[0].iov_base = 0;
-                free(req);
+                continue_reading(w, _);
+            }
+            free_request(w, req);
+            break;
+
+
+        case EVENT_TYPE_WRITE:
+            if (req->file && !finish_file_write(w, req, cqe->res))
+                break;
+            if (req->buf_id != -1)
+                put_buffer(w, req->buf_id);
+            else
+                put_broadcast(w, req->broadcast);
+            free_request(w, req);
+            break;
+
+
+        case EVENT_TYPE_SPLICE_IN:
+            if (!cqe->res) {
+                peer_finished(w, req->conn);
+                free_request(w, req);
                 break;
+            }
+            req->conn->splice_remaining -= cqe->res;
+            req->conn->pipe_pending = cqe->res;
+            req->conn->cold->pipe_filled_at = w->now;
+            w->bytes_spliced += cqe->res;
+            add_splice_request(w, req->conn, EVENT_TYPE_SPLICE_OUT);
+            free_request(w, req);
+            break;
 
 
-            case EVENT_TYPE_WRITE:
-                for (int i = 0; i < req->iovec_count; i++) {
-                    free(req->iov[i].iov_base);
-                    req->iov[i].iov_base = 0;
+        case EVENT_TYPE_SPLICE_OUT:
+            if (cqe->res <= 0) {
+                /* The rest of the payload still goes through the pipe, and is dropped */
+                fail_file_write(w, req->conn->file, cqe->res ? -cqe->res : EIO);
+                int err = drain_pipe(req->conn);
+                if (err) {
+                    log_conn(w, LOG_ERROR, req->conn, "cannot drain pipe", err);
+                    close_connection(w, req->conn);
+                    free_request(w, req);
+                    break;
                 }
-                free(req);
+                req->conn->file->off += req->conn->pipe_pending;
+                req->conn->pipe_pending = 0;
+            } else {
+                req->conn->pipe_pending -= cqe->res;
+                req->conn->file->off += cqe->res;
+                w->bytes_written += cqe->res;
+                file_progress(w, req->conn->file, cqe->res);
+                checkpoint_file(w, req->conn->file, 0);
+            }
+            if (!req->conn->pipe_pending)
+                hist_record(&w->write_lat_hist, w->now - req->conn->cold->pipe_filled_at);
+            if (req->conn->pipe_pending)
+                add_splice_request(w, req->conn, EVENT_TYPE_SPLICE_OUT);
+            else if (req->conn->splice_remaining)
+                add_splice_request(w, req->conn, EVENT_TYPE_SPLICE_IN);
+            else
+                finish_splice(w, req->conn);
+            free_request(w, req);
+            break;
+
+
+        case EVENT_TYPE_STAGE_IN:
+            if (!cqe->res) {
+                peer_finished(w, req->conn);
+                free_request(w, req);
                 break;
+            }
+            if (req->conn->file->digest.type) {
+                digest_update(&req->conn->file->digest,
+                              req->conn->file->stage + req->conn->file->stage_fill, cqe->res);
+                w->digested_bytes += cqe->res;
+            }
+            req->conn->file->stage_fill += cqe->res;
+            req->conn->splice_remaining -= cqe->res;
+            w->bytes_read += cqe->res;
+            if (req->conn->file->stage_fill == DIRECT_CHUNK)
+                flush_stage(w, req->conn, req->conn->file, DIRECT_CHUNK);
+            if (req->conn->splice_remaining)
+                continue_reading(w, req->conn);
+            else
+                finish_splice(w, req->conn);
+            free_request(w, req);
+            break;
+
+
+        case EVENT_TYPE_STAGE_OUT:
+            if (req->conn) {
+                if (!finish_file_write(w, req, cqe->res)) break;
+                put_stage(w, req->iov[0].iov_base);
+            } else {
+                /* The tail of a direct upload, its last reference */
+                if (!file_write_done(w, req, cqe->res)) break;
+                free(req->iov[0].iov_base);
+                put_file(w, req->file);
+            }
+            free_request(w, req);
+            break;
+
+
+        case EVENT_TYPE_MANIFEST:
+            if (!finish_file_write(w, req, cqe->res)) break;
+            free(req->iov[0].iov_base);
+            free_request(w, req);
+            break;
+
+
+        case EVENT_TYPE_CONTROL:
+            handle_commands(w);
+            add_control_request(w);
+            free_request(w, req);
+            break;
+    }
+}
 
+int worker_cpu(uint32_t id, int sq_thread)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 1) cpus = 1;
+    return (pin_cpu + id * (sqpoll ? 2 : 1) + sq_thread) % cpus;
+}
+
+/*
+ * Each iteration submits every SQE queued while handling the previous batch
+ * and waits for at least one completion in a single io_uring_enter(), then
+ * handles all completions already in the CQ ring before advancing it once.
+ * */
+
+void *server_loop(void *arg) {
+    worker *w = arg;
+    struct io_uring_cqe *cqe;
+    unsigned head, count;
 
+    if (pin_cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(worker_cpu(w->id, 0), &set);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set))
+            fprintf(stderr, "worker %u: cannot pin to cpu %d\n", w->id, worker_cpu(w->id, 0));
+    }
+    for (int slot = 0; slot < (fixed_files ? ACCEPT_BATCH : 1); ++slot)
+        add_accept_request(w, slot);
+    add_control_request(w);
+    w->group_ts.tv_sec = group_commit_ms / 1000;
+    w->group_ts.tv_nsec = (group_commit_ms % 1000) * 1000000ULL;
+    if (idle_timeout || stall_timeout) {
+        w->wheel_tick = now_ns() / WHEEL_TICK_NS;
+        w->tick_ts.tv_sec = WHEEL_TICK_MS / 1000;
+        w->tick_ts.tv_nsec = (WHEEL_TICK_MS % 1000) * 1000000;
+        add_tick_request(w);
+    }
+    while (1) {
+        /* Completions already posted (e.g. by the SQ thread) need no wait */
+        int ret = submit(w, io_uring_cq_ready(&w->ring) ? 0 : 1);
+        if (ret < 0 && ret != -EINTR) {
+            errno = -ret;
+            fatal_error("io_uring_submit_and_wait");
         }
-        /* Mark this request as processed */
-        io_uring_cqe_seen(&ring, cqe);
+        w->now = now_ns();
+        count = 0;
+        io_uring_for_each_cqe(&w->ring, head, cqe) {
+            handle_completion(w, cqe);
+            ++count;
+        }
+        /* Mark this batch as processed */
+        io_uring_cq_advance(&w->ring, count);
+        if (count) hist_record(&w->batch_hist, count);
     }
+    return 0x0;
 }
 
 void *input(void *args)
@@ -369,67 +4031,477 @@ void *input(void *args)
         printf("1. FILE\n");
         printf("2. SCREEN\n");
         printf("Kraken> ");
-        read(0, loc_cmd, 0x20);
+        if (read(0, loc_cmd, 0x20) <= 0) return 0x0;
         _ = atoll(loc_cmd);
         switch (_)
         {
         case FILE:
-            loccmd = zh_malloc(0x20);
-            memset(loccmd, 0, 0x20);
-            memcpy(loccmd, "FILE", 4);
-            _ = -1;
+            loccmd = "FILE";
             break;
         case SCREEN:
-            loccmd = zh_malloc(0x20);
-            memset(loccmd, 0, 0x20);
-            memcpy(loccmd, "SCREEN", 6);
-            _ = -1;
+            loccmd = "SCREEN";
             break;
         default:
-            _ = -1;
-            break;
+            continue;
         }
-        pthread_mutex_lock(&mutex);
-        for (uint64_t conn = 0; conn < MAX_CONN; ++conn)
+        /* Hand the command to every worker, each one fans it out to its own connections */
+        size_t len = strlen(loccmd);
+        broadcast *payload = zh_malloc(sizeof(*payload) + len);
+        payload->refs = worker_count;
+        payload->len = len;
+        payload->queued = now_ns();
+        memcpy(payload->text, loccmd, len);
+        for (uint32_t i = 0; i < worker_count; ++i)
         {
-            if (conns_list[conn])
-            {
-                struct request *req = zh_malloc(sizeof(*req) + sizeof(struct iovec));
-                req->iov[0].iov_base = strndup(loccmd, strlen(loccmd));
-                req->iov[0].iov_len = strlen(loccmd);
-                req->iovec_count = 1;
-                req->client_socket = conns_list[conn]->sockfd;
-                add_write_request(req);            
+            worker *w = &workers[i];
+            command *cmd = zh_malloc(sizeof(*cmd));
+            cmd->payload = payload;
+            cmd->waiter = 0x0;
+            post_command(w, cmd);
+        }
+    }
+}
+
+/*
+ * ^C, read from signal_fd like SIGUSR1, so the last metrics and logs are
+ * written from a plain thread rather than a signal handler. The rings go
+ * with the process.
+ * */
+
+void shut_down()
+{
+    printf("^C pressed. Shutting down.\n");
+    fflush(stdout);
+    print_stats(STDOUT_FILENO);
+    flush_logs();
+    if (stats_path) unlink(stats_path);
+    exit(0);
+}
+
+/*
+ * Serves the metrics off the hot path: SIGUSR1 and SIGINT (blocked in every
+ * other thread) dump them to stdout, the latter then exits, and with -S
+ * every client connecting to the unix socket gets a dump and is
+ * disconnected.
+ *   kill -USR1 $(pgrep -x main)      socat - UNIX-CONNECT:kraken.sock
+ * */
+
+void *stats_loop(void *args)
+{
+    struct pollfd fds[2] = {
+        { .fd = signal_fd, .events = POLLIN },
+        { .fd = stats_socket, .events = POLLIN },
+    };
+    while (1) {
+        if (poll(fds, stats_socket >= 0 ? 2 : 1, -1) < 0) {
+            if (errno == EINTR) continue;
+            fatal_error("poll()");
+        }
+        if (fds[0].revents & POLLIN) {
+            struct signalfd_siginfo info;
+            if (read(signal_fd, &info, sizeof(info)) == sizeof(info)) {
+                if (info.ssi_signo == SIGINT) shut_down();
+                fflush(stdout);
+                print_stats(STDOUT_FILENO);
             }
         }
-        free(loccmd);
-        pthread_mutex_unlock(&mutex);
+        if (stats_socket >= 0 && (fds[1].revents & POLLIN)) {
+            int client = accept4(stats_socket, NULL, NULL, SOCK_CLOEXEC);
+            if (client < 0) continue;
+            print_stats(client);
+            close(client);
+        }
+    }
+    return 0x0;
+}
+
+void setup_stats()
+{
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGUSR1);
+    sigaddset(&mask, SIGINT);
+    /* A stats client hanging up early must not kill the server */
+    signal(SIGPIPE, SIG_IGN);
+    /* Threads created from now on inherit the mask */
+    if (pthread_sigmask(SIG_BLOCK, &mask, NULL))
+        fatal_error("pthread_sigmask()");
+    signal_fd = signalfd(-1, &mask, SFD_CLOEXEC);
+    if (signal_fd < 0) fatal_error("signalfd()");
+    if (stats_path) {
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (strlen(stats_path) >= sizeof(addr.sun_path)) {
+            fprintf(stderr, "stats socket path too long: %s\n", stats_path);
+            exit(1);
+        }
+        strcpy(addr.sun_path, stats_path);
+        stats_socket = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (stats_socket < 0) fatal_error("socket(AF_UNIX)");
+        unlink(stats_path);
+        if (bind(stats_socket, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+            fatal_error("bind() stats socket");
+        if (listen(stats_socket, 16) < 0)
+            fatal_error("listen() stats socket");
     }
 }
 
 void init()
 {
-    if (pthread_mutex_init(&mutex, NULL) != 0) fatal_error("pthread_mutex_init()");
-    params.flags |= IORING_SETUP_SQPOLL;
-    params.sq_thread_idle = 120000; // 2 minutes in ms
-    //io_uring_queue_init_params(QUEUE_DEPTH, &ring, &params);
+    if (sqpoll) {
+        params.flags |= IORING_SETUP_SQPOLL;
+        params.sq_thread_idle = sq_idle;
+    }
+    /*
+     * Every connection needs a socket and may hold an upload file and a
+     * splice pipe, which fall back if they cannot be had. A registered table
+     * may not be bigger than the limit either.
+     */
+    struct rlimit rl;
+    rlim_t extra = fixed_files ? FIXED_FILE_SLOTS : 0;
+    rlim_t want = (rlim_t)max_conn * 2 + extra + RESERVED_FDS;
+    if (getrlimit(RLIMIT_NOFILE, &rl) < 0) fatal_error("getrlimit()");
+    if (rl.rlim_cur < want) {
+        rlim_t cur = rl.rlim_cur;
+        rl.rlim_cur = want < rl.rlim_max ? want : rl.rlim_max;
+        if (setrlimit(RLIMIT_NOFILE, &rl) < 0) rl.rlim_cur = cur;
+    }
+    if (rl.rlim_cur < (rlim_t)max_conn + extra + RESERVED_FDS) {
+        uint32_t fit = rl.rlim_cur > extra + RESERVED_FDS ? rl.rlim_cur - extra - RESERVED_FDS : 1;
+        fprintf(stderr, "RLIMIT_NOFILE is %lu, admitting %u connections instead of %u\n",
+                (unsigned long)rl.rlim_cur, fit, max_conn);
+        max_conn = fit;
+    }
+    /*
+     * Each connection keeps a read armed, so the CQ may have to hold one
+     * completion per connection of a worker plus a full SQ worth of others.
+     * The kernel clamps it to its maximum and queues overflow internally.
+     */
+    uint32_t per_worker = (max_conn + worker_count - 1) / worker_count;
+    params.flags |= IORING_SETUP_CQSIZE | IORING_SETUP_CLAMP;
+    params.cq_entries = (per_worker > QUEUE_DEPTH ? per_worker : QUEUE_DEPTH) * 2;
 }
 
-void sigint_handler(int signo)
+/*
+ * Registers the sparse file table and reserves its socket range for
+ * IORING_FILE_INDEX_ALLOC. Returns 0 if the kernel cannot do either.
+ * */
+
+int setup_fixed_files(worker *w)
 {
-    printf("^C pressed. Shutting down.\n");
-    io_uring_queue_exit(&ring);
-    exit(0);
+    int ret = io_uring_register_files_sparse(&w->ring, max_conn + FIXED_FILE_SLOTS);
+    if (ret < 0) {
+        fprintf(stderr, "io_uring_register_files_sparse: %s\n", strerror(-ret));
+        return 0;
+    }
+    ret = io_uring_register_file_alloc_range(&w->ring, 0, max_conn);
+    if (ret < 0) {
+        fprintf(stderr, "io_uring_register_file_alloc_range: %s\n", strerror(-ret));
+        io_uring_unregister_files(&w->ring);
+        return 0;
+    }
+    for (uint32_t slot = max_conn + FIXED_FILE_SLOTS; slot-- > max_conn;)
+        w->file_slots[w->file_slots_top++] = slot;
+    return 1;
+}
+
+/*
+ * Maps the worker's share of arena_size as staging chunks for direct
+ * uploads, from explicit hugepages if any are reserved, otherwise asking for
+ * transparent ones, and registers it as fixed buffer 0. Without the
+ * registration chunks are written with plain writes.
+ * */
+
+void setup_arena(worker *w)
+{
+    uint64_t share = arena_size / worker_count;
+    if (share > MAX_ARENA) share = MAX_ARENA;
+    w->arena_chunks = share / DIRECT_CHUNK ? share / DIRECT_CHUNK : 1;
+    w->arena_len = ((size_t)w->arena_chunks * DIRECT_CHUNK + HUGE_PAGE_SZ - 1) & ~((size_t)HUGE_PAGE_SZ - 1);
+    w->arena = mmap(NULL, w->arena_len, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (w->arena != MAP_FAILED) {
+        w->arena_huge = 1;
+    } else {
+        w->arena = mmap(NULL, w->arena_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (w->arena == MAP_FAILED) fatal_error("mmap() arena");
+        madvise(w->arena, w->arena_len, MADV_HUGEPAGE);
+    }
+    w->arena_chunks = w->arena_len / DIRECT_CHUNK;
+    w->stage_free = zh_malloc(w->arena_chunks * sizeof(*w->stage_free));
+    for (uint32_t chunk = w->arena_chunks; chunk-- > 0;)
+        w->stage_free[w->stage_free_top++] = chunk;
+    struct iovec iov = { .iov_base = w->arena, .iov_len = w->arena_len };
+    int ret = io_uring_register_buffers(&w->ring, &iov, 1);
+    if (ret < 0)
+        fprintf(stderr, "worker %u: io_uring_register_buffers: %s, arena writes are not fixed\n",
+                w->id, strerror(-ret));
+    else
+        w->arena_registered = 1;
+}
+
+/*
+ * Creates the chunk store and loads the chunks it already has into the
+ * index, removing the .tmp files of writes cut short. This blocks, before
+ * the workers start.
+ * */
+
+void setup_chunk_store()
+{
+    uint64_t seed = 0x2545f4914f6cdd1d;
+    for (int i = 0; i < 256; ++i) {
+        seed ^= seed << 13;
+        seed ^= seed >> 7;
+        seed ^= seed << 17;
+        gear[i] = seed;
+    }
+    grow_chunk_index();
+    if (mkdir("davy_jones_locker", 0777) < 0 && errno != EEXIST) fatal_error("mkdir()");
+    if (mkdir(CHUNK_STORE, 0777) < 0 && errno != EEXIST) fatal_error("mkdir()");
+    chunk_dir_fd = open(CHUNK_STORE, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (chunk_dir_fd < 0) fatal_error("open(" CHUNK_STORE ")");
+    for (int i = 0; i < 256; ++i) {
+        char sub[3];
+        struct dirent *ent;
+        sprintf(sub, "%02x", i);
+        if (mkdirat(chunk_dir_fd, sub, 0777) < 0 && errno != EEXIST) fatal_error("mkdirat()");
+        int fd = openat(chunk_dir_fd, sub, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        DIR *dir = fd < 0 ? 0x0 : fdopendir(fd);
+        if (!dir) fatal_error("opendir()");
+        while ((ent = readdir(dir))) {
+            uint8_t key[SHA256_LEN];
+            size_t len = strlen(ent->d_name);
+            if (len == 2 * SHA256_LEN && digest_parse_hex(DIGEST_SHA256, ent->d_name, key))
+                chunk_insert(key);
+            else if (len > strlen(CHUNK_TMP_SUFFIX) &&
+                     !strcmp(ent->d_name + len - strlen(CHUNK_TMP_SUFFIX), CHUNK_TMP_SUFFIX))
+                unlinkat(fd, ent->d_name, 0);
+        }
+        closedir(dir);
+    }
+}
+
+void init_worker(worker *w, uint32_t id)
+{
+    int ret;
+    w->id = id;
+    w->server_socket = setup_listening_socket(DEFAULT_SERVER_PORT);
+    grow_conn_table(w);
+    setup_request_pool(&w->req_pool);
+    w->log_ring = zh_malloc(LOG_RING_SZ * sizeof(*w->log_ring));
+    struct io_uring_params p = params;
+    if (sqpoll && pin_cpu >= 0) {
+        p.flags |= IORING_SETUP_SQ_AFF;
+        p.sq_thread_cpu = worker_cpu(id, 1);
+    }
+    if ((ret = io_uring_queue_init_params(QUEUE_DEPTH, &w->ring, &p)) < 0) {
+        errno = -ret;
+        fatal_error("io_uring_queue_init_params()");
+    }
+    setup_buffer_ring(w);
+    if (direct_threshold || backend == BACKEND_DEDUP) setup_arena(w);
+    if (fixed_files && !setup_fixed_files(w)) {
+        /* Later workers run on the same kernel, only the first may fall back */
+        if (id) fatal_error("setup_fixed_files()");
+        fprintf(stderr, "registered files not supported, using plain fds\n");
+        fixed_files = 0;
+    }
+    w->event_fd = eventfd(0, EFD_CLOEXEC);
+    if (w->event_fd < 0) fatal_error("eventfd()");
+}
+
+/* Parses a byte count with an optional K, M or G suffix */
+uint64_t parse_size(const char *arg)
+{
+    char *end;
+    uint64_t size = strtoull(arg, &end, 0);
+    switch (toupper((unsigned char)*end)) {
+    case 'G': size <<= 10; /* fall through */
+    case 'M': size <<= 10; /* fall through */
+    case 'K': size <<= 10;
+    }
+    return size;
 }
 
-int main() {
-    signal(SIGINT, sigint_handler);
+void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-w workers] [-n max_connections] [-a single|multishot] [-t copy|splice] [-d write_depth] [-m mem_budget] [-c conn_budget] [-f] [-q] [-i sq_idle_ms] [-C cpu] [-S stats_socket] [-I idle_timeout] [-P stall_timeout] [-D none|eof|group] [-g group_commit_ms] [-O direct_threshold] [-A arena_size] [-L log_file] [-k none|crc32c|sha256] [-B plain|dedup] [-b buffer_count] [-s buffer_size] [-r request_pool_size]\n", prog);
+    fprintf(stderr, "  -w  number of event loop threads, each with its own ring and listening socket (default: online CPUs)\n");
+    fprintf(stderr, "  -n  connections admitted over all workers, more are closed right after accept (default %u)\n",
+            DEFAULT_MAX_CONN);
+    fprintf(stderr, "  -a  accept one connection per SQE or keep a multishot accept armed (default multishot)\n");
+    fprintf(stderr, "  -t  move uploads that announce their size from socket to file with splice, or always copy through read buffers (default splice)\n");
+    fprintf(stderr, "  -d  writes in flight per uploaded file before its connection stops reading (default %u)\n",
+            DEFAULT_WRITE_DEPTH);
+    fprintf(stderr, "  -m  bytes read but not yet on disk the whole server may hold, K/M/G suffixes, 0 for no limit (default %uM)\n",
+            DEFAULT_MEM_BUDGET >> 20);
+    fprintf(stderr, "  -c  same limit for a single connection (default: none)\n");
+    fprintf(stderr, "  -f  use sockets and upload files through a registered file table, accepts become single shot\n");
+    fprintf(stderr, "  -q  let a kernel SQ thread per worker poll for submissions (SQPOLL)\n");
+    fprintf(stderr, "  -i  ms the SQ thread spins without work before sleeping (default %u)\n", DEFAULT_SQ_IDLE);
+    fprintf(stderr, "  -C  pin worker i's loop to cpu + 2i and its SQ thread to cpu + 2i + 1 (cpu + i without -q)\n");
+    fprintf(stderr, "  -S  unix socket path that hands out a metrics dump to every client, SIGUSR1 prints one to stdout\n");
+    fprintf(stderr, "  -I  seconds a connection may send nothing between uploads before it is dropped, 0 for never (default %u)\n",
+            DEFAULT_IDLE_TIMEOUT);
+    fprintf(stderr, "  -P  seconds an upload may make no progress before it is dropped and its file removed, 0 for never (default %u)\n",
+            DEFAULT_STALL_TIMEOUT);
+    fprintf(stderr, "  -D  when an upload counts as stored and is acked: written, fdatasync'd on its own, or fdatasync'd with the others of a group commit window (default none)\n");
+    fprintf(stderr, "  -g  length of the group commit window in ms (default %u)\n", DEFAULT_GROUP_COMMIT_MS);
+    fprintf(stderr, "  -O  uploads announcing at least this many bytes are staged in aligned chunks and written with O_DIRECT, K/M/G suffixes (default: none)\n");
+    fprintf(stderr, "  -A  bytes of staging arena for -O over all workers, K/M/G suffixes (default %uM)\n",
+            DEFAULT_ARENA >> 20);
+    fprintf(stderr, "  -L  append the JSON lines log to this file instead of stderr\n");
+    fprintf(stderr, "  -k  digest uploads that name no algorithm themselves and store it as <name>.crc32c or <name>.sha256 (default none)\n");
+    fprintf(stderr, "  -B  store uploads as they are, or as manifests of content-defined chunks kept once in %s (default plain)\n",
+            CHUNK_STORE);
+    fprintf(stderr, "  -b  number of pooled read buffers per worker, power of two <= %u (default %u)\n",
+            MAX_BUF_COUNT, DEFAULT_BUF_COUNT);
+    fprintf(stderr, "  -s  size of each read buffer in bytes (default %u)\n", READ_SZ);
+    fprintf(stderr, "  -r  number of preallocated request objects per worker (default %u)\n", DEFAULT_REQ_POOL_SIZE);
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+    while ((opt = getopt(argc, argv, "w:n:a:t:d:m:c:fqi:C:S:I:P:D:g:O:A:L:k:B:b:s:r:")) != -1) {
+        switch (opt) {
+        case 'w':
+            worker_count = strtoul(optarg, NULL, 0);
+            if (!worker_count) usage(argv[0]);
+            break;
+        case 'n':
+            max_conn = strtoul(optarg, NULL, 0);
+            if (!max_conn) usage(argv[0]);
+            break;
+        case 't':
+            if (!strcmp(optarg, "copy"))
+                transfer_mode = TRANSFER_COPY;
+            else if (!strcmp(optarg, "splice"))
+                transfer_mode = TRANSFER_SPLICE;
+            else
+                usage(argv[0]);
+            break;
+        case 'd':
+            write_depth = strtoul(optarg, NULL, 0);
+            if (!write_depth) usage(argv[0]);
+            break;
+        case 'm':
+            mem_budget = parse_size(optarg);
+            break;
+        case 'c':
+            conn_budget = parse_size(optarg);
+            break;
+        case 'f':
+            fixed_files = 1;
+            break;
+        case 'q':
+            sqpoll = 1;
+            break;
+        case 'i':
+            sq_idle = strtoul(optarg, NULL, 0);
+            break;
+        case 'C':
+            pin_cpu = atoi(optarg);
+            if (pin_cpu < 0) usage(argv[0]);
+            break;
+        case 'S':
+            stats_path = optarg;
+            break;
+        case 'I':
+            idle_timeout = strtoull(optarg, NULL, 0) * 1000000000ULL;
+            break;
+        case 'P':
+            stall_timeout = strtoull(optarg, NULL, 0) * 1000000000ULL;
+            break;
+        case 'D':
+            if (!strcmp(optarg, "none"))
+                durability = DURABILITY_NONE;
+            else if (!strcmp(optarg, "eof"))
+                durability = DURABILITY_EOF;
+            else if (!strcmp(optarg, "group"))
+                durability = DURABILITY_GROUP;
+            else
+                usage(argv[0]);
+            break;
+        case 'g':
+            group_commit_ms = strtoul(optarg, NULL, 0);
+            break;
+        case 'O':
+            direct_threshold = parse_size(optarg);
+            break;
+        case 'A':
+            arena_size = parse_size(optarg);
+            if (!arena_size) usage(argv[0]);
+            break;
+        case 'L':
+            log_path = optarg;
+            break;
+        case 'B':
+            if (!strcmp(optarg, "plain"))
+                backend = BACKEND_PLAIN;
+            else if (!strcmp(optarg, "dedup"))
+                backend = BACKEND_DEDUP;
+            else
+                usage(argv[0]);
+            break;
+        case 'k':
+            if (!strcmp(optarg, "none"))
+                default_digest = DIGEST_NONE;
+            else if (!strcmp(optarg, "crc32c"))
+                default_digest = DIGEST_CRC32C;
+            else if (!strcmp(optarg, "sha256"))
+                default_digest = DIGEST_SHA256;
+            else
+                usage(argv[0]);
+            break;
+        case 'a':
+            if (!strcmp(optarg, "single"))
+                accept_mode = ACCEPT_SINGLE;
+            else if (!strcmp(optarg, "multishot"))
+                accept_mode = ACCEPT_MULTISHOT;
+            else
+                usage(argv[0]);
+            break;
+        case 'b':
+            buf_count = strtoul(optarg, NULL, 0);
+            break;
+        case 's':
+            buf_size = strtoul(optarg, NULL, 0);
+            break;
+        case 'r':
+            req_pool_size = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (!buf_count || buf_count > MAX_BUF_COUNT || (buf_count & (buf_count - 1)) || !buf_size || !req_pool_size)
+        usage(argv[0]);
+    if (!worker_count) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        worker_count = cpus > 0 ? cpus : 1;
+    }
+    worker_budget = mem_budget ? mem_budget / worker_count : UINT64_MAX;
     //if (geteuid()) fatal_error("You need root privileges to run this program.\n");
-    int server_socket = setup_listening_socket(DEFAULT_SERVER_PORT);
     init();
-    io_uring_queue_init(QUEUE_DEPTH, &ring, 0);
+    digest_setup();
+    if (backend == BACKEND_DEDUP) setup_chunk_store();
+    setup_logs();
+    setup_stats();
+    workers = calloc(worker_count, sizeof(worker));
+    if (!workers) fatal_error("calloc()");
+    for (uint32_t i = 0; i < worker_count; ++i)
+        init_worker(&workers[i], i);
+    for (uint32_t i = 0; i < worker_count; ++i)
+        if (pthread_create(&workers[i].thread, NULL, &server_loop, &workers[i]))
+            fatal_error("pthread_create()");
     pthread_create(&thread, NULL, &input, NULL);
-    server_loop(server_socket);
-    pthread_mutex_destroy(&mutex);
+    if (pthread_create(&log_thread, NULL, &log_loop, NULL))
+        fatal_error("pthread_create()");
+    if (pthread_create(&stats_thread, NULL, &stats_loop, NULL))
+        fatal_error("pthread_create()");
+    for (uint32_t i = 0; i < worker_count; ++i)
+        pthread_join(workers[i].thread, NULL);
     return 0;
 }
@@ -0,0 +1,34 @@
+import asyncio
+import sys
+import time
+
+IP = '127.0.0.1'
+PORT = 8000
+CONNECTIONS = 10000
+CONCURRENCY = 512
+
+# Opens CONNECTIONS connections as fast as possible, at most CONCURRENCY at a
+# time so the server never runs out of connection slots, and closes each one
+# right after the handshake. Once the listen backlog is full the connect rate
+# is bounded by how fast the server drains it, e.g.
+#   ./main -a single    vs    ./main -a multishot
+
+async def storm_one(sem):
+    async with sem:
+        _, writer = await asyncio.open_connection(IP, PORT)
+        writer.close()
+        await writer.wait_closed()
+
+async def storm(count, concurrency):
+    sem = asyncio.Semaphore(concurrency)
+    start = time.monotonic()
+    await asyncio.gather(*(storm_one(sem) for _ in range(count)))
+    return time.monotonic() - start
+
+def main():
+    count = int(sys.argv[1]) if len(sys.argv) > 1 else CONNECTIONS
+    elapsed = asyncio.run(storm(count, CONCURRENCY))
+    print("{} connections in {:.3f}s, {:.0f} accepts/s".format(count, elapsed, count / elapsed))
+
+if __name__=='__main__':
+    main()
@@ -0,0 +1,30 @@
+#!/bin/sh
+# Runs loadgen against main, fast and slow over a fixed sweep of connection
+# counts, file sizes and send sizes, starting a fresh server for every run,
+# and writes one CSV row per run to $1 (default benchmark.csv). Server output
+# goes to benchmark.log. Run from the repository root after make. The sweep
+# can be narrowed with the variables below, e.g.
+#   CONNS="1 8" SIZES=1M CHUNKS=64K ./playground/benchmark.sh quick.csv
+# MAIN_FLAGS is passed to main, e.g. MAIN_FLAGS="-w 1 -q".
+
+OUT=${1:-benchmark.csv}
+LOG=${LOG:-benchmark.log}
+CONNS=${CONNS:-"1 8 64"}
+SIZES=${SIZES:-"64K 1M 16M"}
+CHUNKS=${CHUNKS:-"4K 64K"}
+LOCKER=davy_jones_locker/127.0.0.1
+
+set -e
+rm -f "$OUT" "$LOG"
+for size in $SIZES; do
+    for chunk in $CHUNKS; do
+        for conns in $CONNS; do
+            ./loadgen -t main -c "$conns" -s "$size" -k "$chunk" -o "$OUT" -- ./main $MAIN_FLAGS 2>>"$LOG"
+            rm -f "$LOCKER"/loadgen_*
+        done
+        for server in fast slow; do
+            ./loadgen -t $server -s "$size" -k "$chunk" -o "$OUT" -- ./$server 2>>"$LOG"
+        done
+    done
+done
+echo "results in $OUT"
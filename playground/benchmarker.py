@@ -8,6 +8,20 @@ PORT_SLOW = 8002
 FILE = 'sample.txt'
 CHUNKSIZE = 4096
 
+# CRC32C as fast and slow print it once the upload is in
+CRC32C_TABLE = []
+for i in range(256):
+    c = i
+    for _ in range(8):
+        c = (c >> 1) ^ 0x82F63B78 if c & 1 else c >> 1
+    CRC32C_TABLE.append(c)
+
+def crc32c(data, crc=0):
+    crc ^= 0xFFFFFFFF
+    for b in data:
+        crc = CRC32C_TABLE[(crc ^ b) & 0xFF] ^ (crc >> 8)
+    return crc ^ 0xFFFFFFFF
+
 def init():
     client_fast = socket.socket(socket.AF_INET, socket.SOCK_STREAM, 0)
     client_fast.connect((IP, PORT_FAST))
@@ -29,7 +43,8 @@ def _file(file, sock : socket.socket):
 def main():
     sz = input("How much? ")
     os.system("head -c {} /dev/urandom > {}".format(sz, FILE))
-    os.system("md5sum {}".format(FILE))
+    with open(FILE, 'rb') as fd:
+        print("crc32c {:08x}".format(crc32c(fd.read())))
     fast, slow = init()
     _file(FILE, fast)
     _file(FILE, slow)
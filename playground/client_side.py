@@ -1,5 +1,6 @@
 from pyautogui import screenshot
 import socket
+import struct
 import io
 from pwn import *
 from time import sleep, time_ns
@@ -7,44 +8,43 @@ from time import sleep, time_ns
 IP = '127.0.0.1'
 PORT = 8000
 CHUNKSIZE = 4096
+FRAME_MAGIC = b'KRK\x01'
+FRAME_TYPE_FILE = 1
 
 def init():
     client = socket.socket(socket.AF_INET, socket.SOCK_STREAM, 0)
     client.connect((IP, PORT))
     return client
 
+# Files go out as frames: header, name, then exactly `length` payload bytes,
+# so they can follow each other on the socket without pauses
+def _frame_header(name, length):
+    name = name.encode()
+    return struct.pack('<4sBBHQ', FRAME_MAGIC, FRAME_TYPE_FILE, 0, len(name), length) + name
+
 def _screen(sock):
     _ = screenshot()
     pic = io.BytesIO()
     _.save(pic, format='PNG')
     pic = pic.getvalue()
     pic_length = len(pic)
-    sock.send(b'\xfe\xdf\x10\x02START_OF_FILEscreenCap_'+str(time_ns()).encode()+b'.png')
-    sleep(1)
-    for i in range((pic_length // CHUNKSIZE) + 1):
-        print(i)
-        sock.send(pic[CHUNKSIZE*i:CHUNKSIZE*i+CHUNKSIZE])
-    sleep(1)
-    sock.send(b'\xff\xff\xff\xff eof')
+    sock.sendall(_frame_header('screenCap_'+str(time_ns())+'.png', pic_length))
+    sock.sendall(pic)
 
 def _file(sock):
     current_dir = os.getcwd()
     files = os.listdir(current_dir)
     for file in files:
         if (os.path.isfile(file)):
-            sleep(0.1)
             f = os.open(file, os.O_RDONLY)
             finf = os.fstat(f)
             print(finf.st_size)
             if file == 'client_side.py' or file == 'client_slow.py':
                 continue
             with open(file, 'rb') as f:
-                sock.send(b'\xfe\xdf\x10\x02START_OF_FILE'+file.encode())
-                sleep(1)
+                sock.sendall(_frame_header(file, finf.st_size))
                 for _ in range((finf.st_size // CHUNKSIZE) + 1):
-                    sock.send(f.read(CHUNKSIZE))
-                sleep(1)
-                sock.send(b'\xff\xff\xff\xff eof')
+                    sock.sendall(f.read(CHUNKSIZE))
 
 
 def main():
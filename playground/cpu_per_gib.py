@@ -0,0 +1,59 @@
+import socket
+import sys
+import os
+import time
+
+IP = '127.0.0.1'
+CHUNKSIZE = 65536
+
+# Streams an upload to a running server and reports how much CPU time the
+# server process spent per GiB received, read from /proc/<pid>/stat.
+#   ./main -t splice   ->  python3 cpu_per_gib.py $(pgrep -x main) 8000 sized 4
+#   ./main -t copy     ->  python3 cpu_per_gib.py $(pgrep -x main) 8000 sized 4
+#   ./fast             ->  python3 cpu_per_gib.py $(pgrep -x fast) 8001 raw 4
+# sized sends the payload size in the upload header so main can splice it,
+# legacy only marks the end of the payload in-band and raw sends bare bytes.
+
+def cpu_seconds(pid):
+    with open('/proc/{}/stat'.format(pid)) as f:
+        fields = f.read().rsplit(')', 1)[1].split()
+    # utime and stime, fields 14 and 15 of the whole line
+    return (int(fields[11]) + int(fields[12])) / os.sysconf('SC_CLK_TCK')
+
+def upload(port, proto, size):
+    chunk = os.urandom(CHUNKSIZE)
+    sock = socket.create_connection((IP, port))
+    if proto == 'sized':
+        sock.sendall(b'\xfe\xdf\x10\x02START_OF_FILEcpu_per_gib\0' + str(size).encode() + b'\0')
+    elif proto == 'legacy':
+        sock.send(b'\xfe\xdf\x10\x02START_OF_FILEcpu_per_gib')
+        time.sleep(0.5)
+    sent = 0
+    while sent < size:
+        n = min(CHUNKSIZE, size - sent)
+        sock.sendall(chunk[:n])
+        sent += n
+    if proto != 'raw':
+        time.sleep(0.5)
+        sock.send(b'\xff\xff\xff\xff eof')
+        time.sleep(0.5)
+    sock.close()
+
+def main():
+    if len(sys.argv) < 4:
+        print("usage: {} pid port sized|legacy|raw [GiB]".format(sys.argv[0]))
+        sys.exit(1)
+    pid, port, proto = int(sys.argv[1]), int(sys.argv[2]), sys.argv[3]
+    gib = float(sys.argv[4]) if len(sys.argv) > 4 else 1
+    size = int(gib * (1 << 30))
+    before = cpu_seconds(pid)
+    start = time.monotonic()
+    upload(port, proto, size)
+    # let the server drain what is still queued
+    time.sleep(1)
+    used = cpu_seconds(pid) - before
+    print("{} GiB in {:.2f}s, server CPU {:.3f}s, {:.3f} CPU s/GiB".format(
+        gib, time.monotonic() - start, used, used / gib))
+
+if __name__=='__main__':
+    main()
@@ -0,0 +1,80 @@
+import socket
+import subprocess
+import selectors
+import resource
+import signal
+import sys
+import time
+
+IP = '127.0.0.1'
+PORT = 8000
+CLIENTS = 1024
+ROUNDS = 20
+
+# Starts ./main with its console on a pipe, connects CLIENTS idle clients and
+# times how long a FILE command typed at the console takes to reach all of
+# them. The client side time includes waking this script up, the server's own
+# "broadcast fan-out" histogram, printed at the end, runs from queueing the
+# command to the last socket write completing:
+#   python3 playground/fanout_latency.py [clients] [rounds] [main options]
+#   python3 playground/fanout_latency.py 1024 20 -w 1
+# Run from the repository root.
+
+def connect(deadline):
+    while True:
+        try:
+            return socket.create_connection((IP, PORT))
+        except ConnectionRefusedError:
+            if time.monotonic() > deadline:
+                raise
+            time.sleep(0.01)
+
+def pct(values, p):
+    return values[min(len(values) - 1, len(values) * p // 100)]
+
+def main():
+    clients = int(sys.argv[1]) if len(sys.argv) > 1 else CLIENTS
+    rounds = int(sys.argv[2]) if len(sys.argv) > 2 else ROUNDS
+    # the server inherits the raised limit too
+    soft, hard = resource.getrlimit(resource.RLIMIT_NOFILE)
+    resource.setrlimit(resource.RLIMIT_NOFILE, (hard, hard))
+    server = subprocess.Popen(['./main'] + sys.argv[3:], stdin=subprocess.PIPE,
+                              stdout=subprocess.PIPE, stderr=subprocess.DEVNULL)
+    try:
+        deadline = time.monotonic() + 5
+        socks = [connect(deadline) for _ in range(clients)]
+        # let the workers accept everything before the first command
+        time.sleep(0.5)
+        sel = selectors.DefaultSelector()
+        for s in socks:
+            sel.register(s, selectors.EVENT_READ)
+        lasts = []
+        for _ in range(rounds):
+            pending = set(socks)
+            start = time.monotonic()
+            server.stdin.write(b'1\n')
+            server.stdin.flush()
+            while pending:
+                events = sel.select(5)
+                if not events:
+                    raise RuntimeError('{} clients got nothing'.format(len(pending)))
+                for key, _ in events:
+                    s = key.fileobj
+                    if s in pending and s.recv(64):
+                        pending.discard(s)
+            lasts.append((time.monotonic() - start) * 1e3)
+            time.sleep(0.05)
+        lasts.sort()
+        print('{} clients, all reached in ms over {} rounds: p50 {:.3f} p90 {:.3f} max {:.3f}'.format(
+            clients, rounds, pct(lasts, 50), pct(lasts, 90), lasts[-1]))
+        for s in socks:
+            s.close()
+    finally:
+        server.send_signal(signal.SIGINT)
+        out = server.communicate()[0].decode(errors='replace')
+    for line in out.splitlines():
+        if line.startswith('all workers') or 'fan-out' in line:
+            print(line)
+
+if __name__=='__main__':
+    main()
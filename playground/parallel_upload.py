@@ -0,0 +1,48 @@
+import socket
+import sys
+import os
+import time
+from threading import Thread, Barrier
+
+IP = '127.0.0.1'
+PORT = 8000
+CHUNKSIZE = 4096
+CLIENTS = 16
+SIZE = 16 * 1024 * 1024
+
+# Uploads SIZE bytes from CLIENTS connections at once and reports the
+# aggregate rate, so runs with a different number of workers can be compared:
+#   ./main -w 1    vs    ./main -w $(nproc)
+# The server needs a moment between the header, the payload and the eof
+# marker, those pauses are excluded from the measurement.
+
+def upload(idx, data, barrier, times):
+    sock = socket.create_connection((IP, PORT))
+    sock.send(b'\xfe\xdf\x10\x02START_OF_FILEparallel_' + str(idx).encode())
+    time.sleep(0.5)
+    barrier.wait()
+    start = time.monotonic()
+    for i in range(0, len(data), CHUNKSIZE):
+        sock.sendall(data[i:i+CHUNKSIZE])
+    times[idx] = (start, time.monotonic())
+    time.sleep(0.5)
+    sock.send(b'\xff\xff\xff\xff eof')
+    time.sleep(0.5)
+    sock.close()
+
+def main():
+    clients = int(sys.argv[1]) if len(sys.argv) > 1 else CLIENTS
+    size = int(sys.argv[2]) if len(sys.argv) > 2 else SIZE
+    data = os.urandom(size)
+    barrier = Barrier(clients)
+    times = [None] * clients
+    threads = [Thread(target=upload, args=(i, data, barrier, times)) for i in range(clients)]
+    for t in threads: t.start()
+    for t in threads: t.join()
+    elapsed = max(t[1] for t in times) - min(t[0] for t in times)
+    total = clients * size
+    print("{} clients, {} MiB in {:.3f}s, {:.1f} MiB/s".format(
+        clients, total >> 20, elapsed, total / elapsed / 1048576))
+
+if __name__=='__main__':
+    main()
@@ -0,0 +1,76 @@
+import socket
+import struct
+import sys
+import os
+import time
+import hashlib
+import random
+
+IP = '127.0.0.1'
+PORT = 8000
+FILES = 100
+SIZE = 256 * 1024
+
+# Pipelines FILES framed uploads back-to-back on one connection, with no
+# pauses, in randomly sized sends so frame headers get split across reads and
+# several frames share a read. Prints the md5 of every file sent, compare
+# with md5sum davy_jones_locker/127.0.0.1/pipeline_*, and checks that the
+# server acked every file with its size.
+
+FRAME_MAGIC = b'KRK\x01'
+FRAME_TYPE_FILE = 1
+FRAME_TYPE_ACK = 2
+HEADER = struct.Struct('<4sBBHQ')
+
+def frame(name, payload):
+    name = name.encode()
+    return HEADER.pack(FRAME_MAGIC, FRAME_TYPE_FILE, 0, len(name), len(payload)) + name + payload
+
+def parse_acks(data):
+    acks = {}
+    while data:
+        magic, kind, _, name_len, length = HEADER.unpack_from(data)
+        assert magic == FRAME_MAGIC and kind == FRAME_TYPE_ACK, data[:16]
+        acks[data[HEADER.size:HEADER.size + name_len].decode()] = length
+        data = data[HEADER.size + name_len:]
+    return acks
+
+def main():
+    count = int(sys.argv[1]) if len(sys.argv) > 1 else FILES
+    size = int(sys.argv[2]) if len(sys.argv) > 2 else SIZE
+    stream = bytearray()
+    digests = []
+    sizes = {}
+    for i in range(count):
+        payload = os.urandom(random.randint(0, size))
+        stream += frame('pipeline_{}'.format(i), payload)
+        digests.append((hashlib.md5(payload).hexdigest(), 'pipeline_{}'.format(i)))
+        sizes['pipeline_{}'.format(i)] = len(payload)
+    sock = socket.create_connection((IP, PORT))
+    start = time.monotonic()
+    pos = 0
+    while pos < len(stream):
+        n = random.randint(1, 3 * 4096)
+        sock.sendall(stream[pos:pos+n])
+        pos += n
+    sock.shutdown(socket.SHUT_WR)
+    # the server acks every file, then closes its side once everything sent
+    # has been handled
+    received = bytearray()
+    while True:
+        data = sock.recv(65536)
+        if not data:
+            break
+        received += data
+    elapsed = time.monotonic() - start
+    acks = parse_acks(bytes(received))
+    if acks != sizes:
+        print("acks do not match: {} of {} files acked".format(len(acks), len(sizes)), file=sys.stderr)
+    sock.close()
+    for digest, name in digests:
+        print(digest, name)
+    print("{} files, {:.1f} MiB in {:.3f}s, {:.1f} MiB/s".format(
+        count, len(stream) / 1048576, elapsed, len(stream) / elapsed / 1048576), file=sys.stderr)
+
+if __name__=='__main__':
+    main()
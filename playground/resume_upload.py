@@ -0,0 +1,97 @@
+import socket
+import struct
+import sys
+import os
+import time
+import hashlib
+import argparse
+
+IP = '127.0.0.1'
+PORT = 8000
+
+# Uploads one file as a resumable frame over a link that drops every --cut
+# bytes: each attempt is reset after sending that much of the payload, and
+# the next one asks the server where to go on from. Prints the md5 of the
+# file, compare with md5sum davy_jones_locker/127.0.0.1/<name>, and how
+# many payload bytes went over the wire. With --restart every attempt sends
+# the file from the start instead, as a client without resume has to.
+
+FRAME_MAGIC = b'KRK\x01'
+FRAME_TYPE_FILE = 1
+FRAME_TYPE_ACK = 2
+FRAME_TYPE_OFFSET = 3
+FRAME_FLAG_RESUME = 0x04
+HEADER = struct.Struct('<4sBBHQ')
+SEND_SZ = 65536
+
+def recv_frame(sock):
+    data = b''
+    while len(data) < HEADER.size:
+        chunk = sock.recv(HEADER.size - len(data))
+        if not chunk:
+            raise ConnectionError('server closed the connection')
+        data += chunk
+    magic, kind, flags, name_len, length = HEADER.unpack(data)
+    assert magic == FRAME_MAGIC, data
+    name = b''
+    while len(name) < name_len:
+        name += sock.recv(name_len - len(name))
+    return kind, name.decode(), length
+
+def attempt(name, payload, content_id, cut, restart):
+    """One connection, returns the payload bytes sent and whether the file was acked"""
+    sock = socket.create_connection((IP, PORT))
+    encoded = name.encode()
+    if restart:
+        sock.sendall(HEADER.pack(FRAME_MAGIC, FRAME_TYPE_FILE, 0, len(encoded), len(payload)) + encoded)
+        off = 0
+    else:
+        sock.sendall(HEADER.pack(FRAME_MAGIC, FRAME_TYPE_FILE, FRAME_FLAG_RESUME, len(encoded),
+                                 len(payload)) + encoded + content_id)
+        kind, _, off = recv_frame(sock)
+        assert kind == FRAME_TYPE_OFFSET, kind
+    end = len(payload) if not cut else min(len(payload), off + cut)
+    for pos in range(off, end, SEND_SZ):
+        sock.sendall(payload[pos:min(end, pos + SEND_SZ)])
+    if end < len(payload):
+        # the link goes down: reset, whatever the server did not read yet is lost
+        sock.setsockopt(socket.SOL_SOCKET, socket.SO_LINGER, struct.pack('ii', 1, 0))
+        sock.close()
+        return end - off, False
+    kind, _, length = recv_frame(sock)
+    sock.close()
+    assert kind == FRAME_TYPE_ACK and length == len(payload), (kind, length)
+    return end - off, True
+
+def main():
+    global IP, PORT
+    parser = argparse.ArgumentParser()
+    parser.add_argument('size', type=int, help='payload bytes, random')
+    parser.add_argument('--name', default='resume_test')
+    parser.add_argument('--cut', type=int, default=0, help='bytes each attempt sends before the link drops')
+    parser.add_argument('--pause', type=float, default=0.2, help='seconds before reconnecting')
+    parser.add_argument('--attempts', type=int, default=100)
+    parser.add_argument('--restart', action='store_true', help='send from the start every time')
+    parser.add_argument('--host', default=IP)
+    parser.add_argument('--port', type=int, default=PORT)
+    args = parser.parse_args()
+    IP, PORT = args.host, args.port
+    payload = os.urandom(args.size)
+    # the content ID names what is uploaded, so a changed file never resumes an old .part
+    content_id = hashlib.sha256(payload).digest()[:16]
+    sent = 0
+    start = time.monotonic()
+    for tries in range(1, args.attempts + 1):
+        n, done = attempt(args.name, payload, content_id, args.cut, args.restart)
+        sent += n
+        if done:
+            break
+        time.sleep(args.pause)
+    elapsed = time.monotonic() - start
+    print(hashlib.md5(payload).hexdigest(), args.name)
+    print("{} after {} attempts: {:.1f} MiB sent for {:.1f} MiB, {:.2f}x, {:.3f}s".format(
+        'stored' if done else 'NOT stored', tries, sent / 1048576, args.size / 1048576,
+        sent / args.size if args.size else 1, elapsed), file=sys.stderr)
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,36 @@
+#!/bin/sh
+# Striped upload throughput against the stripe count on loopback with
+# emulated latency. A netem qdisc delays every packet on lo by DELAY, so the
+# round trip is twice that, while a fresh main receives SIZE bytes RUNS
+# times per stripe count; prints the best MiB/s of each count as CSV and
+# removes the qdisc again. Needs root and sch_netem, DELAY=0 skips netem.
+# Run from the repository root after make, e.g.
+#   DELAY=10ms STRIPES="1 4 16" ./playground/stripe_bench.sh
+# MAIN_FLAGS is passed to main, e.g. MAIN_FLAGS="-w 4 -D group".
+
+DELAY=${DELAY:-20ms}
+SIZE=${SIZE:-268435456}
+STRIPES=${STRIPES:-"1 2 4 8 16"}
+RUNS=${RUNS:-3}
+LOCKER=davy_jones_locker/127.0.0.1
+
+set -e
+if [ "$DELAY" != 0 ]; then
+    tc qdisc add dev lo root netem delay "$DELAY"
+    trap 'tc qdisc del dev lo root' EXIT
+fi
+./main $MAIN_FLAGS < /dev/null > stripe_bench.log 2>&1 &
+MAIN=$!
+trap 'kill $MAIN; [ "$DELAY" = 0 ] || tc qdisc del dev lo root' EXIT
+sleep 1
+echo "stripes,delay,mib_s"
+for stripes in $STRIPES; do
+    best=0
+    for run in $(seq "$RUNS"); do
+        rate=$(python3 playground/striped_upload.py "$SIZE" --stripes "$stripes" --name stripe_bench 2>&1 >/dev/null |
+               sed 's/.*, \([0-9.]*\) MiB\/s/\1/')
+        best=$(echo "$rate $best" | awk '{print ($1 > $2) ? $1 : $2}')
+        rm -f "$LOCKER"/stripe_bench
+    done
+    echo "$stripes,$DELAY,$best"
+done
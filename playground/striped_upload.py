@@ -0,0 +1,86 @@
+import socket
+import struct
+import sys
+import os
+import time
+import hashlib
+import argparse
+from threading import Thread
+
+IP = '127.0.0.1'
+PORT = 8000
+
+# Uploads one file striped over several connections: the file is cut into
+# --range byte ranges dealt round-robin to --stripes connections, each of
+# which pipelines its ranges as FRAME_FLAG_STRIPE frames under one transfer
+# ID and then waits for their acks. Prints the md5 of the file, compare
+# with md5sum davy_jones_locker/127.0.0.1/<name>, and the rate from the
+# first byte sent to the ack saying the whole file is stored.
+
+FRAME_MAGIC = b'KRK\x01'
+FRAME_TYPE_FILE = 1
+FRAME_TYPE_ACK = 2
+FRAME_FLAG_STRIPE = 0x08
+HEADER = struct.Struct('<4sBBHQ')
+STRIPE = struct.Struct('<16sQQ')
+SEND_SZ = 1 << 20
+
+def recv_exact(sock, n):
+    data = b''
+    while len(data) < n:
+        chunk = sock.recv(n - len(data))
+        if not chunk:
+            raise ConnectionError('server closed the connection')
+        data += chunk
+    return data
+
+def stripe(name, payload, transfer_id, ranges, landed, done_at):
+    sock = socket.create_connection((IP, PORT))
+    encoded = name.encode()
+    for start, end in ranges:
+        sock.sendall(HEADER.pack(FRAME_MAGIC, FRAME_TYPE_FILE, FRAME_FLAG_STRIPE, len(encoded), end - start) +
+                     encoded + STRIPE.pack(transfer_id, start, len(payload)))
+        for pos in range(start, end, SEND_SZ):
+            sock.sendall(payload[pos:min(end, pos + SEND_SZ)])
+    # every range is acked with the bytes of the file stored so far
+    for _ in ranges:
+        magic, kind, flags, name_len, length = HEADER.unpack(recv_exact(sock, HEADER.size))
+        recv_exact(sock, name_len)
+        assert magic == FRAME_MAGIC and kind == FRAME_TYPE_ACK and flags & FRAME_FLAG_STRIPE, (kind, flags)
+        landed.append(length)
+        if length == len(payload):
+            done_at.append(time.monotonic())
+    sock.close()
+
+def upload(name, payload, stripes, range_size):
+    transfer_id = os.urandom(16)
+    cuts = [(start, min(len(payload), start + range_size)) for start in range(0, len(payload), range_size)] or [(0, 0)]
+    landed, done_at = [], []
+    threads = [Thread(target=stripe, args=(name, payload, transfer_id, cuts[i::stripes], landed, done_at))
+               for i in range(min(stripes, len(cuts)))]
+    start = time.monotonic()
+    for t in threads: t.start()
+    for t in threads: t.join()
+    assert len(done_at) == 1, 'the file was not completed exactly once: {}'.format(sorted(landed))
+    return done_at[0] - start
+
+def main():
+    global IP, PORT
+    parser = argparse.ArgumentParser()
+    parser.add_argument('size', type=int, help='payload bytes, random')
+    parser.add_argument('--stripes', type=int, default=4, help='connections')
+    parser.add_argument('--range', type=int, default=0, help='bytes per range (default: one per connection)')
+    parser.add_argument('--name', default='striped_test')
+    parser.add_argument('--host', default=IP)
+    parser.add_argument('--port', type=int, default=PORT)
+    args = parser.parse_args()
+    IP, PORT = args.host, args.port
+    payload = os.urandom(args.size)
+    range_size = args.range or max(1, -(-args.size // args.stripes))
+    elapsed = upload(args.name, payload, args.stripes, range_size)
+    print(hashlib.md5(payload).hexdigest(), args.name)
+    print("{} stripes: {:.1f} MiB in {:.3f}s, {:.1f} MiB/s".format(
+        args.stripes, args.size / 1048576, elapsed, args.size / elapsed / 1048576), file=sys.stderr)
+
+if __name__ == '__main__':
+    main()
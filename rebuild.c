@@ -0,0 +1,125 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <errno.h>
+#include "digest.h"
+#include "chunkstore.h"
+
+#define CHUNK_MAX               (1 << 20)   // more than the server ever cuts
+
+/*
+ * Turns a manifest written by main -B dedup back into the file it stands
+ * for, reading its chunks from the store in order. Every chunk is checked
+ * against its SHA-256 and length before it is written out.
+ */
+
+/*
+ One function that prints the system call and the error details
+ and then exits with error code 1. Non-zero meaning things didn't go well.
+ */
+void fatal_error(const char *syscall) {
+    perror(syscall);
+    exit(1);
+}
+
+/*
+ * Helper function for cleaner looking code.
+ * */
+
+void *zh_malloc(size_t size) {
+    void *buf = malloc(size);
+    if (!buf) {
+        fprintf(stderr, "Fatal error: unable to allocate memory.\n");
+        exit(1);
+    }
+    return buf;
+}
+
+void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-s store] manifest [output]\n", prog);
+    fprintf(stderr, "  -s  chunk store the manifest refers to (default %s)\n", CHUNK_STORE);
+    fprintf(stderr, "  the file is written to output, or to stdout\n");
+    exit(1);
+}
+
+void write_all(int fd, const uint8_t *buf, size_t len)
+{
+    while (len) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) fatal_error("write()");
+        buf += n;
+        len -= n;
+    }
+}
+
+/* Reads the chunk named hex into buf, returns its length or -1 */
+ssize_t read_chunk(const char *store, const char *hex, uint8_t *buf)
+{
+    char path[4096];
+    ssize_t len = 0, n;
+    snprintf(path, sizeof(path), "%s/%.2s/%s", store, hex, hex);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    while (len < CHUNK_MAX && (n = read(fd, buf + len, CHUNK_MAX - len)) > 0)
+        len += n;
+    close(fd);
+    return n < 0 ? -1 : len;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *store = CHUNK_STORE;
+    char line[MANIFEST_LINE_MAX + 2];
+    uint8_t key[SHA256_LEN], sum[SHA256_LEN];
+    uint64_t chunks = 0, bytes = 0;
+    int opt, out = STDOUT_FILENO;
+    while ((opt = getopt(argc, argv, "s:")) != -1) {
+        if (opt != 's') usage(argv[0]);
+        store = optarg;
+    }
+    if (optind != argc - 1 && optind != argc - 2)
+        usage(argv[0]);
+    FILE *manifest = fopen(argv[optind], "r");
+    if (!manifest) fatal_error("fopen()");
+    if (!fgets(line, sizeof(line), manifest) || strcmp(line, MANIFEST_MAGIC "\n")) {
+        fprintf(stderr, "%s: not a manifest\n", argv[optind]);
+        exit(1);
+    }
+    if (optind == argc - 2) {
+        out = open(argv[optind + 1], O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (out < 0) fatal_error("open()");
+    }
+    digest_setup();
+    uint8_t *buf = zh_malloc(CHUNK_MAX);
+    while (fgets(line, sizeof(line), manifest)) {
+        char hex[2 * SHA256_LEN + 1];
+        unsigned long len;
+        struct sha256_ctx sha;
+        if (sscanf(line, "%64s %lu", hex, &len) != 2 || strlen(hex) != 2 * SHA256_LEN ||
+            !digest_parse_hex(DIGEST_SHA256, hex, key)) {
+            fprintf(stderr, "line %lu of the manifest is malformed\n", chunks + 2);
+            exit(1);
+        }
+        ssize_t got = read_chunk(store, hex, buf);
+        if (got < 0) {
+            fprintf(stderr, "chunk %s: %s\n", hex, strerror(errno));
+            exit(1);
+        }
+        sha256_init(&sha);
+        sha256_update(&sha, buf, got);
+        sha256_final(&sha, sum);
+        if ((unsigned long)got != len || memcmp(sum, key, SHA256_LEN)) {
+            fprintf(stderr, "chunk %s is damaged\n", hex);
+            exit(1);
+        }
+        write_all(out, buf, got);
+        ++chunks;
+        bytes += got;
+    }
+    fprintf(stderr, "%lu chunks, %lu bytes\n", chunks, bytes);
+    return 0;
+}
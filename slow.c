@@ -11,6 +11,7 @@
 #include <fcntl.h>
 #include <arpa/inet.h>
 #include <pthread.h>
+#include "digest.h"
 
 #define DEFAULT_SERVER_PORT     8002
 #define READ_SZ                 4096
@@ -99,6 +100,7 @@ void server_loop(int server_socket)
     writeiov.iov_len = WRITE_SZ;
     int file_fd = open("slow.tmp", O_WRONLY | O_CREAT | O_TRUNC | O_APPEND,
                                     S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+    uint32_t crc = 0;
     while (1)
     {
         uint32_t sz = readv(client, &readiov, 1);
@@ -109,6 +111,8 @@ void server_loop(int server_socket)
             ((double)tend.tv_sec + 1.0e-9*tend.tv_nsec) -
             ((double)tstart.tv_sec + 1.0e-9*tstart.tv_nsec));
             close(file_fd);
+            close(client);
+            printf("[slow] crc32c %08x\n", crc);
             break;
         }
         if (first)
@@ -117,6 +121,7 @@ void server_loop(int server_socket)
             clock_gettime(CLOCK_MONOTONIC, &tstart);
         }
         //printf("recved %d\n", sz);
+        crc = crc32c(crc, readiov.iov_base, sz);
         writeiov.iov_base = readiov.iov_base, WRITE_SZ ? sz : WRITE_SZ <= sz;
         writeiov.iov_len = WRITE_SZ ? sz : WRITE_SZ <= sz;
         writev(file_fd, &writeiov, 1);
@@ -126,9 +131,9 @@ void server_loop(int server_socket)
 int main()
 {
     signal(SIGINT, sigint_handler);
+    digest_setup();
     int server_socket = setup_listening_socket(DEFAULT_SERVER_PORT);
     server_loop(server_socket);
-    system("md5sum slow.tmp");
     system("shred slow.tmp");
     system("rm slow.tmp");
 }